@@ -17,6 +17,10 @@
 #include <asm/atomic.h>
 #include <linux/sched.h>
 #include <linux/cred.h>  /* current_uid, current_euid */
+#include <linux/mutex.h>
+#include <linux/shrinker.h>
+#include <linux/device.h>
+#include <linux/seq_file.h>
 
 #include "scull.h"
 
@@ -46,14 +50,23 @@ static int scull_s_open(struct inode *inode, struct file *filp)
 	}
 
 	/* then, everything else is copied from the bare scull device */
-	if ((filp->f_flags & O_ACCMODE) == O_WRONLY)
-		scull_trim(dev);
+	if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
+		if (down_write_killable(&dev->sem)) {
+			atomic_inc(&scull_s_available);
+			return -ERESTARTSYS;
+		}
+		scull_trim(dev);	/* only unhooks the data */
+		up_write(&dev->sem);
+	}
 	filp->private_data = dev;
+	filp->f_mapping = &dev->mapping;
+	atomic_inc(&dev->opens);
 	return 0;
 }
 
 static int scull_s_release(struct inode *inode, struct file *filp)
 {
+	atomic_dec(&scull_s_device.opens);
 	atomic_inc(&scull_s_available);		/* release the device */
 	return 0;
 }
@@ -66,6 +79,12 @@ struct file_operations scull_sngl_fops = {
 	.llseek		= scull_llseek,
 	.read		= scull_read,
 	.write		= scull_write,
+	.read_iter	= scull_read_iter,
+	.write_iter	= scull_write_iter,
+	.mmap		= scull_mmap,
+	.fallocate	= scull_fallocate,
+	.splice_read	= scull_splice_read,
+	.splice_write	= iter_file_splice_write,
 	.unlocked_ioctl	= scull_ioctl,
 	.open		= scull_s_open,
 	.release	= scull_s_release
@@ -100,14 +119,25 @@ static int scull_u_open(struct inode *inode, struct file *filp)
 	spin_unlock(&scull_u_lock);
 
 	/* then everything else is copied from the bare scull device */
-	if ((filp->f_flags & O_ACCMODE) == O_WRONLY)
-		scull_trim(dev);
+	if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
+		if (down_write_killable(&dev->sem)) {
+			spin_lock(&scull_u_lock);
+			scull_u_count--;
+			spin_unlock(&scull_u_lock);
+			return -ERESTARTSYS;
+		}
+		scull_trim(dev);	/* only unhooks the data */
+		up_write(&dev->sem);
+	}
 	filp->private_data = dev;
+	filp->f_mapping = &dev->mapping;
+	atomic_inc(&dev->opens);
 	return 0;
 }
 
 static int scull_u_release(struct inode *inode, struct file *filp)
 {
+	atomic_dec(&scull_u_device.opens);
 	spin_lock(&scull_u_lock);
 	scull_u_count--;		/* nothing else */
 	spin_unlock(&scull_u_lock);
@@ -122,6 +152,12 @@ struct file_operations scull_user_fops = {
 	.llseek		= scull_llseek,
 	.read		= scull_read,
 	.write		= scull_write,
+	.read_iter	= scull_read_iter,
+	.write_iter	= scull_write_iter,
+	.mmap		= scull_mmap,
+	.fallocate	= scull_fallocate,
+	.splice_read	= scull_splice_read,
+	.splice_write	= iter_file_splice_write,
 	.unlocked_ioctl	= scull_ioctl,
 	.open		= scull_u_open,
 	.release	= scull_u_release
@@ -161,9 +197,20 @@ static int scull_w_open(struct inode *inode, struct file *filp)
 	spin_unlock(&scull_w_lock);
 
 	/* then, everything else is copied from the bare scull device */
-	if ((filp->f_flags & O_ACCMODE) == O_WRONLY)
-		scull_trim(dev);
+	if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
+		if (down_write_killable(&dev->sem)) {
+			spin_lock(&scull_w_lock);
+			if (--scull_w_count == 0)
+				wake_up_interruptible_sync(&scull_w_wait);
+			spin_unlock(&scull_w_lock);
+			return -ERESTARTSYS;
+		}
+		scull_trim(dev);	/* only unhooks the data */
+		up_write(&dev->sem);
+	}
 	filp->private_data = dev;
+	filp->f_mapping = &dev->mapping;
+	atomic_inc(&dev->opens);
 	return 0;
 }
 
@@ -171,6 +218,7 @@ static int scull_w_release(struct inode *inode, struct file *filp)
 {
 	int temp;
 
+	atomic_dec(&scull_w_device.opens);
 	spin_lock(&scull_w_lock);
 	scull_w_count--;
 	temp = scull_w_count;
@@ -186,6 +234,12 @@ struct file_operations scull_wusr_fops = {
 	.llseek		= scull_llseek,
 	.read		= scull_read,
 	.write		= scull_write,
+	.read_iter	= scull_read_iter,
+	.write_iter	= scull_write_iter,
+	.mmap		= scull_mmap,
+	.fallocate	= scull_fallocate,
+	.splice_read	= scull_splice_read,
+	.splice_write	= iter_file_splice_write,
 	.unlocked_ioctl	= scull_ioctl,
 	.open		= scull_w_open,
 	.release	= scull_w_release
@@ -202,24 +256,29 @@ struct file_operations scull_wusr_fops = {
 struct scull_listitem {
 	struct scull_dev device;
 	dev_t key;
+	int count;			/* number of openings */
 	struct list_head list;
 };
 
-/* The list of devices, and a lock to protect it */
+/*
+ * The list of devices, most recently opened first, and a lock to protect
+ * it. Closed devices are reclaimed under memory pressure, from the tail.
+ */
 static LIST_HEAD(scull_c_list);
-static spinlock_t scull_c_lock; //= SPIN_LOCK_UNLOCKED;
+static DEFINE_MUTEX(scull_c_mutex);
+static unsigned long scull_c_closed;	/* devices nobody has open */
 
 /* A placeholder scull_dev which really just holds the cdev stuff */
 static struct scull_dev scull_c_device;
 
-/* Look for a device or create one if missing */
+/* Look for a device or create one if missing; takes an opening */
 static struct scull_dev *scull_c_lookfor_device(dev_t key)
 {
 	struct scull_listitem *lptr;
 
 	list_for_each_entry(lptr, &scull_c_list, list) {
 		if (lptr->key == key)
-			return &(lptr->device);
+			goto found;
 	}
 
 	/* not found */
@@ -230,17 +289,26 @@ static struct scull_dev *scull_c_lookfor_device(dev_t key)
 	/* initialize the device */
 	memset(lptr, 0, sizeof(struct scull_listitem));
 	lptr->key = key;
-	scull_trim(&(lptr->device));		/* initialize it */
-	init_MUTEX(&(lptr->device.sem));
+	if (scull_dev_init(&(lptr->device))) {	/* initialize it */
+		scull_dev_cleanup(&(lptr->device));
+		kfree(lptr);
+		return NULL;
+	}
 
 	/* place it in the list */
 	list_add(&lptr->list, &scull_c_list);
+	scull_c_closed++;
 
+found:
+	if (lptr->count++ == 0)
+		scull_c_closed--;
+	list_move(&lptr->list, &scull_c_list);	/* keep it off the tail */
 	return &(lptr->device);
 }
 
 static int scull_c_open(struct inode *inode, struct file *filp)
 {
+	struct scull_listitem *lptr;
 	struct scull_dev *dev;
 	dev_t key;
 
@@ -251,34 +319,107 @@ static int scull_c_open(struct inode *inode, struct file *filp)
 	key = tty_devnum(current->signal->tty);
 
 	/* look for a scullc device in the list */
-	spin_lock(&scull_c_lock);
+	mutex_lock(&scull_c_mutex);
 	dev = scull_c_lookfor_device(key);
-	spin_unlock(&scull_c_lock);
+	mutex_unlock(&scull_c_mutex);
 
 	if (!dev)
 		return -ENOMEM;
 
 	/* then, everything else is copied from the bare scull device */
-	if ((filp->f_flags & O_ACCMODE) == O_WRONLY)
-		scull_trim(dev);
+	if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
+		if (down_write_killable(&dev->sem)) {
+			mutex_lock(&scull_c_mutex);
+			lptr = container_of(dev, struct scull_listitem, device);
+			if (--lptr->count == 0)
+				scull_c_closed++;
+			mutex_unlock(&scull_c_mutex);
+			return -ERESTARTSYS;
+		}
+		scull_trim(dev);	/* only unhooks the data */
+		up_write(&dev->sem);
+	}
 	filp->private_data = dev;
+	filp->f_mapping = &dev->mapping;
+	atomic_inc(&dev->opens);
 	return 0;
 }
 
 static int scull_c_release(struct inode *inode, struct file *filp)
 {
+	struct scull_listitem *lptr;
+
 	/*
-	 * Nothing to do because the device is persistent.
-	 * A 'real' cloned device should be freed on last close
+	 * The device outlives its last close, but from then on the shrinker
+	 * may reclaim it.
 	 */
+	lptr = container_of(filp->private_data, struct scull_listitem, device);
+	atomic_dec(&lptr->device.opens);
+	mutex_lock(&scull_c_mutex);
+	if (--lptr->count == 0)
+		scull_c_closed++;
+	mutex_unlock(&scull_c_mutex);
 	return 0;
 }
 
+/*
+ * Memory pressure: free the cloned devices nobody has open, least recently
+ * opened first. Their data is lost, as if they had never been opened. A
+ * mapping outlives the close and points at the device, which stays.
+ */
+static unsigned long scull_c_count(struct shrinker *shrink,
+				   struct shrink_control *sc)
+{
+	return READ_ONCE(scull_c_closed);
+}
+
+static unsigned long scull_c_scan(struct shrinker *shrink,
+				  struct shrink_control *sc)
+{
+	struct scull_listitem *lptr, *next;
+	unsigned long freed = 0;
+	LIST_HEAD(victims);
+
+	if (!mutex_trylock(&scull_c_mutex))
+		return SHRINK_STOP;	/* an open may be allocating */
+	list_for_each_entry_safe_reverse(lptr, next, &scull_c_list, list) {
+		if (freed >= sc->nr_to_scan)
+			break;
+		if (lptr->count || atomic_read(&lptr->device.mapped) ||
+		    work_busy(&lptr->device.relayout_work))
+			continue;	/* in use, mapped, or being re-laid out */
+		list_move(&lptr->list, &victims);
+		scull_c_closed--;
+		freed++;
+	}
+	mutex_unlock(&scull_c_mutex);
+
+	/* off the list and closed: nobody else can reach them */
+	list_for_each_entry_safe(lptr, next, &victims, list) {
+		list_del(&lptr->list);
+		scull_dev_cleanup(&(lptr->device));
+		kfree(lptr);
+	}
+	return freed;
+}
+
+static struct shrinker scull_c_shrinker = {
+	.count_objects	= scull_c_count,
+	.scan_objects	= scull_c_scan,
+	.seeks		= DEFAULT_SEEKS,
+};
+
 struct file_operations scull_priv_fops = {
 	.owner		= THIS_MODULE,
 	.llseek		= scull_llseek,
 	.read		= scull_read,
 	.write		= scull_write,
+	.read_iter	= scull_read_iter,
+	.write_iter	= scull_write_iter,
+	.mmap		= scull_mmap,
+	.fallocate	= scull_fallocate,
+	.splice_read	= scull_splice_read,
+	.splice_write	= iter_file_splice_write,
 	.unlocked_ioctl	= scull_ioctl,
 	.open		= scull_c_open,
 	.release	= scull_c_release
@@ -298,6 +439,36 @@ static struct scull_adev_info {
 
 #define SCULL_N_ADEVS	4
 
+/*
+ * The inventory lines of access device "i" (see /proc/scull in main.c).
+ * scullpriv stands for its clones, one line each, named after the terminal
+ * they belong to. The list lock is only ever held briefly, and never for
+ * I/O.
+ */
+int scull_access_inventory_count(void)
+{
+	return scull_a_firstdev ? SCULL_N_ADEVS : 0;
+}
+
+void scull_access_inventory(struct seq_file *s, int i)
+{
+	struct scull_adev_info *devinfo = scull_access_devs + i;
+	struct scull_listitem *lptr;
+
+	if (devinfo->sculldev != &scull_c_device) {
+		seq_printf(s, "%s access", devinfo->name);
+		scull_inventory_dev(s, devinfo->sculldev);
+		return;
+	}
+	mutex_lock(&scull_c_mutex);
+	list_for_each_entry(lptr, &scull_c_list, list) {
+		seq_printf(s, "%s:%u:%u clone", devinfo->name,
+			   MAJOR(lptr->key), MINOR(lptr->key));
+		scull_inventory_dev(s, &lptr->device);
+	}
+	mutex_unlock(&scull_c_mutex);
+}
+
 /*
  * Set up a single device.
  */
@@ -306,16 +477,17 @@ static void scull_access_setup(dev_t devno, struct scull_adev_info *devinfo)
 	struct scull_dev *dev = devinfo->sculldev;
 	int err;
 
-	/* Initialize the device structure */
-	dev->quantum	= scull_quantum;
-	dev->qset	= scull_qset;
-	init_MUTEX(&dev->sem);
-
 	/* The cdev stuff */
 	cdev_init(&dev->cdev, devinfo->fops);
 	kobject_set_name(&dev->cdev.kobj, devinfo->name);
 	dev->cdev.owner = THIS_MODULE;
 
+	/* Initialize the device structure */
+	if (scull_dev_init(dev)) {
+		printk(KERN_NOTICE "Error initializing %s\n", devinfo->name);
+		return;
+	}
+
 	err = cdev_add(&dev->cdev, devno, 1);
 	if (err) {
 		printk(KERN_NOTICE "Error %d adding %s\n", err, devinfo->name);
@@ -323,6 +495,8 @@ static void scull_access_setup(dev_t devno, struct scull_adev_info *devinfo)
 	}
 	else {
 		printk(KERN_NOTICE "%s registered at %x\n", devinfo->name, devno);
+		device_create_with_groups(scull_class, NULL, devno, dev->stats,
+					  scull_stats_groups, devinfo->name);
 	}
 }
 
@@ -341,6 +515,9 @@ int scull_access_init(dev_t firstdev)
 	/* Set up each device */
 	for (i = 0; i < SCULL_N_ADEVS; i++)
 		scull_access_setup(firstdev + i, scull_access_devs + i);
+
+	if (register_shrinker(&scull_c_shrinker))
+		printk(KERN_NOTICE "sculla: can't register the shrinker\n");
 	return SCULL_N_ADEVS;
 }
 
@@ -353,17 +530,20 @@ void scull_access_cleanup(void)
 	struct scull_listitem *lptr, *next;
 	int i;
 
+	unregister_shrinker(&scull_c_shrinker);
+
 	/* Clean up the static devs */
 	for  (i = 0; i < SCULL_N_ADEVS; i++) {
 		struct scull_dev *dev = scull_access_devs[i].sculldev;
+		device_destroy(scull_class, scull_a_firstdev + i);
 		cdev_del(&dev->cdev);
-		scull_trim(scull_access_devs[i].sculldev);
+		scull_dev_cleanup(scull_access_devs[i].sculldev);
 	}
 
 	/* And all the cloned devices */
 	list_for_each_entry_safe(lptr, next, &scull_c_list, list) {
 		list_del(&lptr->list);
-		scull_trim(&(lptr->device));
+		scull_dev_cleanup(&(lptr->device));
 		kfree(lptr);
 	}
 
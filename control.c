@@ -0,0 +1,290 @@
+/*
+ * control.c -- bare and pipe devices made at run time
+ *
+ * /dev/scull-control takes two ioctl()s: SCULL_IOCXCREATE makes a device,
+ * SCULL_IOCTDESTROY takes it away. Each such device has a minor number of
+ * its own, in a region that follows the static devices, and a node made
+ * through the scull class. Nothing is allocated for it beyond its
+ * descriptor and counters until it is used: the data of a bare device
+ * comes with the first write, the buffer of a pipe with the first open.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/errno.h>
+#include <linux/types.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/idr.h>
+#include <linux/mutex.h>
+#include <linux/capability.h>
+#include <linux/seq_file.h>
+#include <asm/uaccess.h>
+
+#include "scull.h"
+
+static int scull_ctl_max = SCULL_CTL_MAX;	/* devices at most */
+module_param(scull_ctl_max, int, S_IRUGO);
+
+static dev_t scull_ctl_devno;		/* the control device; ids follow */
+static int scull_ctl_nr;		/* minors registered, 0 if none */
+static struct cdev scull_ctl_cdev;
+static struct device *scull_ctl_device;
+
+/*
+ * A device made at run time. The embedded struct device is the last thing
+ * to go: the cdev holds a reference to it for as long as a file is open.
+ */
+struct scull_dyn {
+	struct device device;
+	int type;			/* SCULL_CTL_BARE or SCULL_CTL_PIPE */
+	union {
+		struct scull_dev bare;
+		struct scull_pipe pipe;
+	};
+};
+
+/* id -> struct scull_dyn; the mutex covers creation and destruction */
+static DEFINE_IDR(scull_ctl_idr);
+static DEFINE_MUTEX(scull_ctl_mutex);
+
+static struct cdev *scull_dyn_cdev(struct scull_dyn *dyn)
+{
+	return dyn->type == SCULL_CTL_BARE ? &dyn->bare.cdev : &dyn->pipe.cdev;
+}
+
+static void scull_dyn_release(struct device *d)
+{
+	struct scull_dyn *dyn = container_of(d, struct scull_dyn, device);
+
+	if (dyn->type == SCULL_CTL_BARE)
+		scull_dev_cleanup(&dyn->bare);
+	else
+		scull_p_dev_cleanup(&dyn->pipe);
+	kfree(dyn);
+}
+
+static int scull_dyn_create(struct scull_ctl *ctl)
+{
+	struct scull_dyn *dyn;
+	struct scull_stats __percpu *stats;
+	int id;
+	int err;
+
+	if (scull_ctl_nr < 2)
+		return -ENOSPC;		/* no room for any */
+	if (ctl->type != SCULL_CTL_BARE && ctl->type != SCULL_CTL_PIPE)
+		return -EINVAL;
+	if (ctl->quantum < 0 || ctl->qset < 0)
+		return -EINVAL;		/* 0 is the default */
+
+	dyn = kzalloc(sizeof(struct scull_dyn), GFP_KERNEL);
+	if (!dyn)
+		return -ENOMEM;
+	dyn->type = ctl->type;
+
+	mutex_lock(&scull_ctl_mutex);
+	id = idr_alloc(&scull_ctl_idr, dyn, 0, scull_ctl_nr - 1, GFP_KERNEL);
+	if (id < 0) {
+		mutex_unlock(&scull_ctl_mutex);
+		kfree(dyn);
+		return id;
+	}
+
+	/* from here on, put_device() cleans up whatever was set up */
+	device_initialize(&dyn->device);
+	dyn->device.devt	= scull_ctl_devno + 1 + id;
+	dyn->device.class	= scull_class;
+	dyn->device.groups	= scull_stats_groups;
+	dyn->device.release	= scull_dyn_release;
+	if (dyn->type == SCULL_CTL_BARE) {
+		cdev_init(&dyn->bare.cdev, &scull_fops);
+		err = scull_dev_init(&dyn->bare);
+		if (ctl->quantum)
+			dyn->bare.quantum = ctl->quantum;
+		if (ctl->qset)
+			dyn->bare.qset = ctl->qset;
+		if (!err && !scull_geometry_ok(dyn->bare.quantum,
+					       dyn->bare.qset))
+			err = -EINVAL;
+		dyn->bare.own_geometry = ctl->quantum || ctl->qset;
+		stats = dyn->bare.stats;
+		if (!err)
+			err = dev_set_name(&dyn->device, "scull-%d", id);
+	} else {
+		cdev_init(&dyn->pipe.cdev, &scull_pipe_fops);
+		err = scull_p_dev_init(&dyn->pipe);
+		stats = dyn->pipe.stats;
+		if (!err)
+			err = dev_set_name(&dyn->device, "scullpipe-%d", id);
+	}
+	dev_set_drvdata(&dyn->device, stats);
+	scull_dyn_cdev(dyn)->owner = THIS_MODULE;
+	if (!err)
+		err = cdev_device_add(scull_dyn_cdev(dyn), &dyn->device);
+	if (err) {
+		idr_remove(&scull_ctl_idr, id);
+		mutex_unlock(&scull_ctl_mutex);
+		put_device(&dyn->device);
+		return err;
+	}
+	mutex_unlock(&scull_ctl_mutex);
+
+	ctl->id = id;
+	return 0;
+}
+
+/*
+ * The node goes at once; files still open keep the device working until
+ * they are closed.
+ */
+static int scull_dyn_destroy(int id)
+{
+	struct scull_dyn *dyn;
+
+	mutex_lock(&scull_ctl_mutex);
+	dyn = idr_find(&scull_ctl_idr, id);
+	if (!dyn) {
+		mutex_unlock(&scull_ctl_mutex);
+		return -ENOENT;
+	}
+	/* the minor and the name are free again once we unlock */
+	cdev_device_del(scull_dyn_cdev(dyn), &dyn->device);
+	idr_remove(&scull_ctl_idr, id);
+	mutex_unlock(&scull_ctl_mutex);
+
+	put_device(&dyn->device);
+	return 0;
+}
+
+static long scull_ctl_ioctl(struct file *filp, unsigned int cmd,
+			    unsigned long arg)
+{
+	struct scull_ctl ctl;
+	int err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	switch (cmd) {
+		case SCULL_IOCXCREATE:
+			if (copy_from_user(&ctl, (void __user *) arg, sizeof(ctl)))
+				return -EFAULT;
+			err = scull_dyn_create(&ctl);
+			if (err)
+				return err;
+			if (put_user(ctl.id, &((struct scull_ctl __user *) arg)->id)) {
+				scull_dyn_destroy(ctl.id);
+				return -EFAULT;
+			}
+			return 0;
+
+		case SCULL_IOCTDESTROY:
+			if (arg > INT_MAX)
+				return -ENOENT;
+			return scull_dyn_destroy(arg);
+
+		default:
+			return -ENOTTY;
+	}
+}
+
+static struct file_operations scull_ctl_fops = {
+	.owner		= THIS_MODULE,
+	.llseek		= no_llseek,
+	.unlocked_ioctl	= scull_ctl_ioctl,
+	.open		= nonseekable_open,
+};
+
+/*
+ * The inventory (see /proc/scull in main.c). "*id" moves on to the first
+ * device at or after it; 0 once there are no more.
+ */
+int scull_ctl_inventory_next(int *id)
+{
+	void *dyn;
+
+	mutex_lock(&scull_ctl_mutex);
+	dyn = idr_get_next(&scull_ctl_idr, id);
+	mutex_unlock(&scull_ctl_mutex);
+	return dyn != NULL;
+}
+
+void scull_ctl_inventory(struct seq_file *s, int id)
+{
+	struct scull_dyn *dyn;
+
+	mutex_lock(&scull_ctl_mutex);
+	dyn = idr_find(&scull_ctl_idr, id);
+	if (dyn && dyn->type == SCULL_CTL_BARE) {
+		seq_printf(s, "%s bare", dev_name(&dyn->device));
+		scull_inventory_dev(s, &dyn->bare);
+	} else if (dyn) {
+		seq_printf(s, "%s pipe", dev_name(&dyn->device));
+		scull_p_inventory_dev(s, &dyn->pipe);
+	}
+	mutex_unlock(&scull_ctl_mutex);
+}
+
+/*
+ * Register the control device and the minors of the devices to come;
+ * return how many minors we took.
+ */
+int scull_ctl_init(dev_t firstdev)
+{
+	int nr = min_t(long, scull_ctl_max, MINORMASK - MINOR(firstdev)) + 1;
+	int err;
+
+	if (nr < 1)
+		return 0;
+	err = register_chrdev_region(firstdev, nr, "scullctl");
+	if (err < 0) {
+		printk(KERN_NOTICE "scull: can't get the control region, error %d\n",
+		       err);
+		return 0;
+	}
+	scull_ctl_devno	= firstdev;
+	scull_ctl_nr	= nr;
+
+	cdev_init(&scull_ctl_cdev, &scull_ctl_fops);
+	scull_ctl_cdev.owner = THIS_MODULE;
+	err = cdev_add(&scull_ctl_cdev, firstdev, 1);
+	if (err) {
+		printk(KERN_NOTICE "Error %d adding scull-control\n", err);
+		return nr;
+	}
+	scull_ctl_device = device_create(scull_class, NULL, firstdev, NULL,
+					 "scull-control");
+	if (IS_ERR(scull_ctl_device)) {
+		printk(KERN_NOTICE "scull: no node for scull-control\n");
+		scull_ctl_device = NULL;
+	}
+	return nr;
+}
+
+/*
+ * This is called by cleanup_module or on failure. No file can be open on
+ * our devices by then, so they all go at once.
+ */
+void scull_ctl_cleanup(void)
+{
+	struct scull_dyn *dyn;
+	int id;
+
+	if (!scull_ctl_nr)
+		return;
+	idr_for_each_entry(&scull_ctl_idr, dyn, id) {
+		cdev_device_del(scull_dyn_cdev(dyn), &dyn->device);
+		put_device(&dyn->device);
+	}
+	idr_destroy(&scull_ctl_idr);
+
+	if (scull_ctl_device)
+		device_destroy(scull_class, scull_ctl_devno);
+	cdev_del(&scull_ctl_cdev);
+	unregister_chrdev_region(scull_ctl_devno, scull_ctl_nr);
+	scull_ctl_nr = 0;
+}
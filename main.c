@@ -2,6 +2,8 @@
 #include <linux/moduleparam.h>
 #include <linux/kernel.h>	/* printk */
 #include <linux/slab.h>		/* kmalloc */
+#include <linux/mm.h>		/* vm_operations_struct, alloc_pages_exact */
+#include <linux/sched/signal.h>	/* fatal_signal_pending() */
 #include <linux/fs.h>
 #include <linux/errno.h>	/* error codes */
 #include <linux/types.h>	/* size_t */
@@ -10,23 +12,63 @@
 #include <linux/seq_file.h>
 #include <linux/cdev.h>
 #include <linux/semaphore.h>	/* sema_init() */
+#include <linux/radix-tree.h>
+#include <linux/uio.h>		/* struct iov_iter */
+#include <linux/srcu.h>
+#include <linux/falloc.h>	/* FALLOC_FL_* */
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/crypto.h>	/* crypto_comp, for LZ4 */
+#include <linux/lz4.h>		/* LZ4_decompress_safe() */
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/refcount.h>
+#include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/file.h>		/* fdget() */
+#include <linux/namei.h>	/* kern_path(), for the image directory */
+#include <linux/sort.h>
+#include <linux/device.h>	/* the scull class, for sysfs */
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
+#include <linux/nodemask.h>	/* node_states, for NUMA placement */
 
 #include <asm/uaccess.h>
 
 #include "scull.h"
 
+#define CREATE_TRACE_POINTS
+#include "scull_trace.h"
+
 /* Our parameters can be set at load time. */
 int scull_major	  = SCULL_MAJOR;
 int scull_minor   = 0;
 int scull_nr_devs = SCULL_NR_DEVS;	/* Number of bare scull devices */
 int scull_quantum = SCULL_QUANTUM;
 int scull_qset	  = SCULL_QSET;
+int scull_page_quanta = 0;		/* take every quantum from the page allocator */
+unsigned long scull_max_bytes;		/* memory budget of the module, 0: none */
+unsigned long scull_dev_max_bytes;	/* memory budget of each device, 0: none */
+int scull_zip	  = 0;			/* new devices compress cold quanta */
+int scull_zip_age = 30;			/* seconds before a quantum set is cold */
+int scull_dedup	  = 0;			/* new devices share identical quanta */
+int scull_lat_hist = 1;			/* keep latency histograms */
+char *scull_image_dir;			/* save and load the data here */
 
 module_param(scull_major, int, S_IRUGO);
 module_param(scull_minor, int, S_IRUGO);
 module_param(scull_nr_devs, int, S_IRUGO);
 module_param(scull_quantum, int, S_IRUGO);
 module_param(scull_qset, int, S_IRUGO);
+module_param(scull_page_quanta, int, S_IRUGO);
+module_param(scull_max_bytes, ulong, S_IRUGO | S_IWUSR);
+module_param(scull_dev_max_bytes, ulong, S_IRUGO | S_IWUSR);
+module_param(scull_zip, int, S_IRUGO);
+module_param(scull_zip_age, int, S_IRUGO | S_IWUSR);
+module_param(scull_dedup, int, S_IRUGO);
+module_param(scull_lat_hist, int, S_IRUGO | S_IWUSR);
+module_param(scull_image_dir, charp, S_IRUGO);
 
 MODULE_AUTHOR("Salym Senyonga <salymsash@gmail.com>");
 MODULE_LICENSE("GPL");
@@ -34,308 +76,1942 @@ MODULE_DESCRIPTION("Scull: the variable-length memory block");
 
 struct scull_dev *scull_devices;	/* allocated in scull_init_module */
 
+static void scull_scan_work(struct work_struct *work);
+static void scull_relayout_work(struct work_struct *work);
+static struct crypto_comp *scull_zip_tfm;
+
+/*
+ * Initialize a bare device structure, ready for scull_trim() and I/O.
+ * The store is only allocated when data is first written. Even when this
+ * fails, the device can go through scull_dev_cleanup().
+ */
+int scull_dev_init(struct scull_dev *dev)
+{
+	RCU_INIT_POINTER(dev->store, NULL);
+	init_rwsem(&dev->sem);
+	dev->quantum	= scull_quantum;
+	dev->qset	= scull_qset;
+	dev->own_geometry = 0;
+	atomic_set(&dev->mapped, 0);
+	address_space_init_once(&dev->mapping);
+	atomic_set(&dev->opens, 0);
+	dev->numa	= SCULL_NUMA_LOCAL;
+	dev->node	= NUMA_NO_NODE;
+	INIT_WORK(&dev->relayout_work, scull_relayout_work);
+	INIT_DELAYED_WORK(&dev->scan_work, scull_scan_work);
+	dev->stats	= alloc_percpu(struct scull_stats);
+	if (!dev->stats)
+		return -ENOMEM;
+	dev->zip	= scull_zip && scull_zip_tfm;
+	dev->dedup	= scull_dedup;
+	if (dev->zip || dev->dedup)
+		queue_delayed_work(scull_wq, &dev->scan_work,
+				   scull_zip_age * HZ);
+	return 0;
+}
+
+/*
+ * Tear a device down: stop its background work and drop its data.
+ */
+void scull_dev_cleanup(struct scull_dev *dev)
+{
+	dev->zip = dev->dedup = 0;
+	cancel_delayed_work_sync(&dev->scan_work);
+	cancel_work_sync(&dev->relayout_work);
+	scull_trim(dev);
+	free_percpu(dev->stats);
+	dev->stats = NULL;
+}
+
+/*
+ * Statistics, in /sys/class/scull/<device>/stats. The driver data of each
+ * class device is its struct scull_stats.
+ */
+struct class *scull_class;
+
+static u64 scull_stat_sum(struct device *d, size_t offset)
+{
+	struct scull_stats __percpu *stats = dev_get_drvdata(d);
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += *(u64 *) ((char *) per_cpu_ptr(stats, cpu) + offset);
+	return sum;
+}
+
+#define SCULL_STAT_ATTR(field)						\
+static ssize_t field##_show(struct device *d,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	return sprintf(buf, "%llu\n", scull_stat_sum(d,			\
+			offsetof(struct scull_stats, field)));		\
+}									\
+static DEVICE_ATTR_RO(field)
+
+SCULL_STAT_ATTR(read_bytes);
+SCULL_STAT_ATTR(read_ops);
+SCULL_STAT_ATTR(write_bytes);
+SCULL_STAT_ATTR(write_ops);
+SCULL_STAT_ATTR(trims);
+SCULL_STAT_ATTR(alloc_fails);
+SCULL_STAT_ATTR(quanta);
+SCULL_STAT_ATTR(contended);
+
+static struct attribute *scull_stats_attrs[] = {
+	&dev_attr_read_bytes.attr,
+	&dev_attr_read_ops.attr,
+	&dev_attr_write_bytes.attr,
+	&dev_attr_write_ops.attr,
+	&dev_attr_trims.attr,
+	&dev_attr_alloc_fails.attr,
+	&dev_attr_quanta.attr,
+	&dev_attr_contended.attr,
+	NULL
+};
+
+static const struct attribute_group scull_stats_group = {
+	.name	= "stats",
+	.attrs	= scull_stats_attrs,
+};
+
+const struct attribute_group *scull_stats_groups[] = {
+	&scull_stats_group,
+	NULL
+};
+
+/*
+ * Latency histograms, one per operation, in debugfs as scull/latency.
+ * Bucket b counts the calls that took [2^(b-1), 2^b) nanoseconds. They are
+ * kept per CPU, and can be turned off with scull_lat_hist=0.
+ */
+#define SCULL_LAT_BUCKETS	40
+
+struct scull_lat {
+	u64 count[SCULL_LAT_NR][SCULL_LAT_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct scull_lat, scull_lat);
+static struct dentry *scull_debugfs;
+
+static const char * const scull_lat_names[SCULL_LAT_NR] = {
+	[SCULL_LAT_READ]	= "read",
+	[SCULL_LAT_WRITE]	= "write",
+	[SCULL_LAT_FOLLOW]	= "follow",
+	[SCULL_LAT_TRIM]	= "trim",
+	[SCULL_LAT_P_READ]	= "p_read",
+	[SCULL_LAT_P_WRITE]	= "p_write",
+	[SCULL_LAT_P_SPACE]	= "p_getwritespace",
+	[SCULL_LAT_SEM]		= "sem_wait",
+};
+
+void scull_lat_add(int op, u64 ns)
+{
+	int bucket = min_t(int, fls64(ns), SCULL_LAT_BUCKETS - 1);
+
+	this_cpu_inc(scull_lat.count[op][bucket]);
+}
+
+u64 scull_lat_start(void)
+{
+	return READ_ONCE(scull_lat_hist) ? ktime_get_ns() : 0;
+}
+
+void scull_lat_end(int op, u64 start)
+{
+	if (start)
+		scull_lat_add(op, ktime_get_ns() - start);
+}
+
+/*
+ * A semaphore found taken was acquired; "wait" is when the wait began.
+ */
+void scull_sem_waited(const void *sem, const char *what, u64 wait)
+{
+	u64 ns = ktime_get_ns() - wait;
+
+	trace_scull_sem_wait(sem, what, ns);
+	scull_lat_add(SCULL_LAT_SEM, ns);
+}
+
+static int scull_lat_show(struct seq_file *s, void *v)
+{
+	u64 count;
+	int op, b, cpu;
+
+	for (op = 0; op < SCULL_LAT_NR; op++) {
+		seq_printf(s, "%s:\n", scull_lat_names[op]);
+		for (b = 0; b < SCULL_LAT_BUCKETS; b++) {
+			count = 0;
+			for_each_possible_cpu(cpu)
+				count += per_cpu(scull_lat, cpu).count[op][b];
+			if (count)
+				seq_printf(s, "  %12llu ns: %llu\n",
+					   b ? 1ULL << (b - 1) : 0, count);
+		}
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(scull_lat);
+
+/*
+ * /proc/scull, the inventory: a line per device, made of counters the I/O
+ * paths keep up to date. Reading it takes no device semaphore and walks no
+ * data, so it never holds up the I/O and costs the same however much the
+ * devices hold. The numbers may be a little stale, never inconsistent
+ * enough to matter.
+ */
+
+/*
+ * The rest of the line of a bare (or access, or cloned) device, after its
+ * name.
+ */
+void scull_inventory_dev(struct seq_file *s, struct scull_dev *dev)
+{
+	struct scull_store *store;
+	int idx;
+	int nid;
+
+	idx = srcu_read_lock(&scull_srcu);
+	store = srcu_dereference(dev->store, &scull_srcu);
+	if (store)
+		seq_printf(s, " size=%lu quantum=%i qset=%i quanta=%li bytes=%li zipped=%li zipbytes=%li",
+			   READ_ONCE(store->size), store->quantum, store->qset,
+			   atomic_long_read(&store->quanta),
+			   atomic_long_read(&store->bytes),
+			   atomic_long_read(&store->zip_raw),
+			   atomic_long_read(&store->zip_bytes));
+	else
+		seq_printf(s, " size=0 quantum=%i qset=%i quanta=0 bytes=0 zipped=0 zipbytes=0",
+			   READ_ONCE(dev->quantum), READ_ONCE(dev->qset));
+	seq_printf(s, " opens=%i numa=", atomic_read(&dev->opens));
+	switch (READ_ONCE(dev->numa)) {
+		case SCULL_NUMA_NODE:
+			seq_printf(s, "node%i", READ_ONCE(dev->node));
+			break;
+		case SCULL_NUMA_INTERLEAVE:
+			seq_puts(s, "interleave");
+			break;
+		default:
+			seq_puts(s, "local");
+	}
+	/* where the plain quanta are */
+	for_each_node_state(nid, N_MEMORY)
+		seq_printf(s, " node%i=%li", nid,
+			   store ? atomic_long_read(&store->node_quanta[nid]) : 0);
+	srcu_read_unlock(&scull_srcu, idx);
+	seq_putc(s, '\n');
+}
+
+/*
+ * Our "position" runs through the bare devices, then the pipes, then the
+ * access devices; each of those files shows its own. The devices made
+ * through /dev/scull-control come last, at their id past all those: the
+ * position skips the ids not in use.
+ */
+static loff_t scull_inventory_count(void)
+{
+	return scull_nr_devs + scull_p_inventory_count() +
+		scull_access_inventory_count();
+}
+
+static void *scull_inventory_start(struct seq_file *s, loff_t *pos)
+{
+	loff_t nr = scull_inventory_count();
+	int id;
+
+	if (*pos >= nr) {
+		if (*pos - nr > INT_MAX)
+			return NULL;
+		id = *pos - nr;
+		if (!scull_ctl_inventory_next(&id))
+			return NULL;	/* No more to read */
+		*pos = nr + id;
+	}
+	return (void *) (long) (*pos + 1);	/* not NULL */
+}
+
+static void *scull_inventory_next(struct seq_file *s, void *v, loff_t *pos)
+{
+	(*pos)++;
+	return scull_inventory_start(s, pos);
+}
+
+static void scull_inventory_stop(struct seq_file *s, void *v)
+{
+	/* There's actually nothing to do here */
+}
+
+static int scull_inventory_show(struct seq_file *s, void *v)
+{
+	long i = (long) v - 1;
+
+	if (i < scull_nr_devs) {
+		seq_printf(s, "scull%li bare", i);
+		scull_inventory_dev(s, scull_devices + i);
+		return 0;
+	}
+	i -= scull_nr_devs;
+	if (i < scull_p_inventory_count()) {
+		scull_p_inventory(s, i);
+		return 0;
+	}
+	i -= scull_p_inventory_count();
+	if (i < scull_access_inventory_count()) {
+		scull_access_inventory(s, i);
+		return 0;
+	}
+	scull_ctl_inventory(s, i - scull_access_inventory_count());
+	return 0;
+}
+
+static const struct seq_operations scull_inventory_ops = {
+	.start	= scull_inventory_start,
+	.next	= scull_inventory_next,
+	.stop	= scull_inventory_stop,
+	.show	= scull_inventory_show
+};
+
+static struct proc_dir_entry *scull_proc;
+
+static void scull_create_proc(void)
+{
+	scull_proc = proc_create_seq("scull", 0, NULL, &scull_inventory_ops);
+	if (!scull_proc)
+		printk(KERN_NOTICE "scull: can't create /proc/scull\n");
+}
+
+static void scull_remove_proc(void)
+{
+	proc_remove(scull_proc);	/* NULL if never created */
+}
+
+
+/*
+ * open and close
+ */
+int scull_open(struct inode *inode, struct file *filp)
+{
+	struct scull_dev *dev;		/* device information */
+
+	dev = container_of(inode->i_cdev, struct scull_dev, cdev);
+	filp->private_data = dev;	/* store dev for quick access in future */
+	filp->f_mapping = &dev->mapping;	/* one for all its nodes */
+
+	/* Now trim to 0 the length of the device if open was write-only */
+	if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
+		if (down_write_killable(&dev->sem))
+			return -ERESTARTSYS;
+		scull_trim(dev);	/* ignore errors */
+		up_write(&dev->sem);
+	}
+	atomic_inc(&dev->opens);
+	return 0;
+}
+
+int scull_release(struct inode *inode, struct file *filp)
+{
+	struct scull_dev *dev = filp->private_data;
+
+	atomic_dec(&dev->opens);
+	return 0;
+}
+
+/*
+ * Background scanning. A device in zip or dedup mode has a delayed work item
+ * that visits its cold quantum sets (untouched for scull_zip_age seconds).
+ * Quanta of zeros found there become SCULL_SLOT_ZERO; in dedup mode the
+ * others are hashed and shared with identical ones; in zip mode whatever is
+ * left gets compressed. Quanta from the page allocator may be mapped into
+ * user space, so stores made of them are never scanned.
+ */
+
+/*
+ * The worker never enters reclaim: the clone shrinker waits for it.
+ */
+#define SCULL_SCAN_GFP	(GFP_NOWAIT | __GFP_NOWARN)
+
+/*
+ * Compression. Readers decompress a quantum into a bounce buffer and leave
+ * it compressed; writers put a plain quantum back in its slot first. The
+ * tfm has one compression workspace, which only the scan worker uses;
+ * readers decompress with LZ4 directly, which needs none, so they run
+ * side by side.
+ */
+static DEFINE_MUTEX(scull_zip_mutex);	/* the tfm's workspace */
+
+int scull_unzip(struct scull_zquantum *zq, void *buf, int quantum)
+{
+	int len = LZ4_decompress_safe((const char *) zq->data, buf, zq->len,
+				      quantum);
+
+	return len == quantum ? 0 : -EIO;
+}
+
 /*
- * Empty out the scull device; must be called with the device semaphore held.
+ * Compress the plain quantum in data[i], if that saves at least an eighth
+ * of it. "buf" is a scratch buffer of one quantum.
  */
-int scull_trim(struct scull_dev *dev)
+static void scull_zip_slot(struct scull_store *store, void **data, int i,
+			   void *buf, struct scull_reap *reap)
 {
-	struct scull_qset *next, *dptr;
-	int qset = dev->qset;		/* "dev" is not null */
+	struct scull_zquantum *zq;
+	unsigned int len = store->quantum - store->quantum / 8;
+	int err;
+
+	mutex_lock(&scull_zip_mutex);
+	err = crypto_comp_compress(scull_zip_tfm, data[i], store->quantum,
+				   buf, &len);
+	mutex_unlock(&scull_zip_mutex);
+	if (err)
+		return;		/* not worth it */
+
+	zq = kmalloc(sizeof(struct scull_zquantum) + len, SCULL_SCAN_GFP);
+	if (!zq)
+		return;
+	zq->len = len;
+	memcpy(zq->data, buf, len);
+
+	scull_forget_slot(store, data[i]);
+	scull_reap_add(reap, data[i]);
+	rcu_assign_pointer(data[i], (void *) ((unsigned long) zq |
+					      SCULL_SLOT_ZIP));
+	atomic_long_add(sizeof(struct scull_zquantum) + len, &store->bytes);
+	atomic_long_add(sizeof(struct scull_zquantum) + len,
+			&scull_used_bytes);
+	atomic_long_add(store->quantum, &store->zip_raw);
+	atomic_long_add(len, &store->zip_bytes);
+}
+
+/*
+ * Deduplication. A plain quantum whose contents match those of a shared one
+ * becomes another reference to it; otherwise it is turned into a shared
+ * quantum itself, so that later copies can find it. Either way the store
+ * stops being charged for it.
+ */
+
+/* Shared quanta with contents worth looking up, by hash */
+static DEFINE_HASHTABLE(scull_dedup_table, 10);
+static DEFINE_SPINLOCK(scull_dedup_lock);
+
+static void scull_free_shared_rcu(struct rcu_head *head)
+{
+	struct scull_shared *sq = container_of(head, struct scull_shared, rcu);
+
+	scull_free_quantum(sq->data, sq->quantum);
+	atomic_long_sub(sq->quantum, &scull_used_bytes);
+	kfree(sq);
+}
+
+/*
+ * Drop a reference to a shared quantum. Its memory is charged to the module
+ * only, not to any store, and goes once the last slot lets go of it.
+ */
+void scull_put_shared(struct scull_shared *sq)
+{
+	if (!refcount_dec_and_lock(&sq->ref, &scull_dedup_lock))
+		return;
+	hash_del(&sq->node);
+	spin_unlock(&scull_dedup_lock);
+	call_srcu(&scull_srcu, &sq->rcu, scull_free_shared_rcu);
+}
+
+static void scull_dedup_slot(struct scull_store *store, void **data, int i,
+			     struct scull_reap *reap)
+{
+	struct scull_shared *sq, *new;
+	void *quantum = data[i];
+	u32 hash = jhash(quantum, store->quantum, store->quantum);
+
+	new = kmalloc(sizeof(struct scull_shared), SCULL_SCAN_GFP);
+	if (!new)
+		return;
+
+	spin_lock(&scull_dedup_lock);
+	hash_for_each_possible(scull_dedup_table, sq, node, hash) {
+		if (sq->hash != hash || sq->quantum != store->quantum ||
+		    memcmp(sq->data, quantum, store->quantum))
+			continue;
+		refcount_inc(&sq->ref);
+		spin_unlock(&scull_dedup_lock);
+		kfree(new);
+		scull_forget_slot(store, quantum);
+		rcu_assign_pointer(data[i], scull_sq_slot(sq));
+		scull_reap_add(reap, quantum);
+		return;
+	}
+	refcount_set(&new->ref, 1);
+	new->quantum	= store->quantum;
+	new->data	= quantum;
+	new->hash	= hash;
+	hash_add(scull_dedup_table, &new->node, hash);
+	spin_unlock(&scull_dedup_lock);
+
+	/* the memory stays, now charged to the module only */
+	atomic_long_sub(store->quantum, &store->bytes);
+	scull_node_add(store, quantum, -1);
+	rcu_assign_pointer(data[i], scull_sq_slot(new));
+}
+
+/*
+ * Scan the plain quanta of one cold quantum set. The plain quanta replaced
+ * go to "reap".
+ */
+static void scull_scan_qset(struct scull_dev *dev, struct scull_store *store,
+			    struct scull_qset *dptr, void *buf,
+			    struct scull_reap *reap)
+{
+	void **data;
+	void *quantum;
 	int i;
 
-	for (dptr = dev->data; dptr; dptr = next) {	/* traverse list items */
-		if (dptr->data) {
-			for (i = 0; i < qset; i++)
-				kfree(dptr->data[i]);
-			kfree(dptr->data);
-			dptr->data = NULL;
+	down(&dptr->sem);
+	data = dptr->data;
+	for (i = 0; data && i < store->qset; i++) {
+		quantum = data[i];
+		if (!quantum || !scull_slot_plain(quantum))
+			continue;
+		if (!memchr_inv(quantum, 0, store->quantum)) {
+			scull_forget_slot(store, quantum);
+			rcu_assign_pointer(data[i], SCULL_SLOT_ZERO);
+			scull_reap_add(reap, quantum);
+		} else if (READ_ONCE(dev->dedup)) {
+			scull_dedup_slot(store, data, i, reap);
+		} else if (READ_ONCE(dev->zip)) {
+			scull_zip_slot(store, data, i, buf, reap);
+		}
+	}
+	up(&dptr->sem);
+}
+
+static void scull_scan_store(struct scull_dev *dev, struct scull_store *store)
+{
+	struct scull_qset *dptr;
+	struct scull_reap *reap;
+	struct radix_tree_iter iter;
+	unsigned long cold = jiffies - READ_ONCE(scull_zip_age) * HZ;
+	void **slot;
+	void *buf;
+
+	if (scull_page_backed(store->quantum))
+		return;
+	buf  = kmalloc(store->quantum, SCULL_SCAN_GFP);
+	reap = scull_reap_alloc(store->quantum, SCULL_SCAN_GFP);
+	if (!buf || !reap)
+		goto out;
+
+	rcu_read_lock();
+	radix_tree_for_each_slot(slot, &store->index, &iter, 0) {
+		dptr = radix_tree_deref_slot(slot);
+		if (radix_tree_deref_retry(dptr)) {
+			slot = radix_tree_iter_retry(&iter);
+			continue;
+		}
+		if (time_after(READ_ONCE(dptr->atime), cold))
+			continue;
+		slot = radix_tree_iter_resume(slot, &iter);
+		rcu_read_unlock();
+		scull_scan_qset(dev, store, dptr, buf, reap);
+		cond_resched();
+		rcu_read_lock();
+	}
+	rcu_read_unlock();
+
+out:
+	if (reap)
+		scull_reap_free(reap);
+	kfree(buf);
+}
+
+static void scull_scan_work(struct work_struct *work)
+{
+	struct scull_dev *dev = container_of(to_delayed_work(work),
+					     struct scull_dev, scan_work);
+	struct scull_store *store;
+
+	/* like a writer: the store can't be trimmed under us */
+	down_read(&dev->sem);
+	store = rcu_dereference_protected(dev->store, 1);
+	if (store)
+		scull_scan_store(dev, store);
+	up_read(&dev->sem);
+
+	if (READ_ONCE(dev->zip) || READ_ONCE(dev->dedup))
+		queue_delayed_work(scull_wq, &dev->scan_work,
+				   READ_ONCE(scull_zip_age) * HZ);
+}
+
+ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
+		   loff_t *f_pos)
+{
+	struct iovec iov;
+	struct iov_iter to;
+	int err;
+
+	err = import_single_range(READ, buf, count, &iov, &to);
+	if (err)
+		return err;
+	return scull_do_read(filp->private_data, &to, f_pos);
+}
+
+ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
+		    loff_t *f_pos)
+{
+	struct iovec iov;
+	struct iov_iter from;
+	int err;
+
+	err = import_single_range(WRITE, (char __user *) buf, count, &iov,
+				  &from);
+	if (err)
+		return err;
+	return scull_do_write(filp->private_data, &from, f_pos);
+}
+
+ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	return scull_do_read(iocb->ki_filp->private_data, to, &iocb->ki_pos);
+}
+
+ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	return scull_do_write(iocb->ki_filp->private_data, from,
+			      &iocb->ki_pos);
+}
+
+/*
+ * Memory mapping. Only devices whose quantum is a whole number of pages can
+ * be mapped: their quanta are page-aligned, so every page of the mapping
+ * lies in exactly one quantum and can be mapped straight into user space.
+ */
+
+static vm_fault_t scull_vma_fault(struct vm_fault *vmf)
+{
+	struct scull_dev *dev = vmf->vma->vm_private_data;
+	struct scull_store *store;
+	struct scull_qset *dptr;
+	loff_t pos = (loff_t) vmf->pgoff << PAGE_SHIFT;
+	unsigned long item;
+	int quantum;
+	int itemsize;
+	int s_pos;
+	int q_pos;
+	int rest;
+	void *data;
+	vm_fault_t retval = VM_FAULT_SIGBUS;
+
+	down_read(&dev->sem);
+	/*
+	 * Reading past the end is a SIGBUS, as for a file; only a write
+	 * (which mkwrite then turns into an extension) gets a fresh quantum.
+	 */
+	store = rcu_dereference_protected(dev->store, 1);
+	if (!(vmf->flags & FAULT_FLAG_WRITE) &&
+	    (!store || pos >= READ_ONCE(store->size)))
+		goto out;
+	store = scull_get_store(dev);
+	if (!store) {
+		retval = VM_FAULT_OOM;
+		goto out;
+	}
+	quantum		= store->quantum;
+	itemsize	= quantum * store->qset;
+	if (!scull_paged(quantum))
+		goto out;	/* the device was trimmed to a new geometry */
+
+	item	= (long) pos / itemsize;
+	rest	= (long) pos % itemsize;
+	s_pos	= rest / quantum;
+	q_pos	= rest % quantum;
+
+	/* pages of the mapping that are not yet backed get a fresh quantum */
+	retval = VM_FAULT_OOM;
+	dptr = scull_follow(store, item);
+	if (!dptr)
+		goto out;
+	down(&dptr->sem);
+	data = scull_fill_slot(store, dptr, s_pos);
+	if (!IS_ERR(data)) {
+		vmf->page = virt_to_page(data + q_pos);
+		get_page(vmf->page);
+		retval = 0;
+	} else if (PTR_ERR(data) == -ENOSPC) {
+		retval = VM_FAULT_SIGBUS;	/* over budget */
+	}
+	up(&dptr->sem);
+
+out:
+	up_read(&dev->sem);
+	return retval;
+}
+
+/*
+ * A page of a shared mapping is about to be dirtied: extend the device to
+ * cover it, and have a re-layout under way copy its quantum set again.
+ * Our pages have no page->mapping, so we lock the page ourselves rather
+ * than have the core revalidate it against the page cache.
+ */
+static vm_fault_t scull_vma_mkwrite(struct vm_fault *vmf)
+{
+	struct scull_dev *dev = vmf->vma->vm_private_data;
+	struct scull_store *store;
+	struct scull_qset *dptr;
+	loff_t end = (loff_t) (vmf->pgoff + 1) << PAGE_SHIFT;
+	unsigned long item;
+
+	down_read(&dev->sem);
+	store = rcu_dereference_protected(dev->store, 1);
+	if (store) {
+		scull_extend(store, end);
+		item = (long) (end - 1) / ((long) store->quantum * store->qset);
+		dptr = scull_lookup(store, item);
+		if (dptr) {
+			down(&dptr->sem);
+			scull_dirty(store, item);
+			up(&dptr->sem);
+		}
+	}
+	up_read(&dev->sem);
+
+	lock_page(vmf->page);
+	return VM_FAULT_LOCKED;
+}
+
+/*
+ * Count the mappings, which pin the geometry of the device.
+ */
+static void scull_vma_open(struct vm_area_struct *vma)
+{
+	struct scull_dev *dev = vma->vm_private_data;
+
+	atomic_inc(&dev->mapped);
+}
+
+static void scull_vma_close(struct vm_area_struct *vma)
+{
+	struct scull_dev *dev = vma->vm_private_data;
+
+	atomic_dec(&dev->mapped);
+}
+
+static const struct vm_operations_struct scull_vm_ops = {
+	.open		= scull_vma_open,
+	.close		= scull_vma_close,
+	.fault		= scull_vma_fault,
+	.page_mkwrite	= scull_vma_mkwrite,
+};
+
+int scull_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct scull_dev *dev = filp->private_data;
+
+	if (!scull_paged(dev->quantum))
+		return -EINVAL;
+
+	vma->vm_ops		= &scull_vm_ops;
+	vma->vm_flags		|= VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_private_data	= dev;
+	scull_vma_open(vma);
+	return 0;
+}
+
+/*
+ * splice() and sendfile(). When the quanta come from the page allocator,
+ * their pages are handed to the pipe as they are, with a reference of their
+ * own, and holes and quanta of zeros go out as the zero page: nothing is
+ * copied. Any other store goes through scull_read_iter(), one copy.
+ * Writing from a pipe always copies, through scull_write_iter().
+ *
+ * As with vmsplice(SPLICE_F_GIFT), the pipe then holds the device's own
+ * pages, not a copy: a write, FALLOC_FL_ZERO_RANGE or hole punched there
+ * before the other end reads them shows through, so it may see data newer
+ * than the splice. A punched quantum stays alive until the pipe lets go of
+ * it. Whoever needs a snapshot of the data should read() it instead.
+ */
+static void scull_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+	put_page(spd->pages[i]);
+}
+
+/*
+ * The pages are the device's, and can't be stolen. Like the ops of the
+ * same name in fs/splice.c, which modules don't get.
+ */
+static int scull_pipe_buf_steal(struct pipe_inode_info *pipe,
+				struct pipe_buffer *buf)
+{
+	return 1;
+}
+
+static const struct pipe_buf_operations scull_pipe_buf_ops = {
+	.confirm	= generic_pipe_buf_confirm,
+	.release	= generic_pipe_buf_release,
+	.steal		= scull_pipe_buf_steal,
+	.get		= generic_pipe_buf_get,
+};
+
+ssize_t scull_splice_read(struct file *in, loff_t *ppos,
+			  struct pipe_inode_info *pipe, size_t len,
+			  unsigned int flags)
+{
+	struct scull_dev *dev = in->private_data;
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages		= pages,
+		.partial	= partial,
+		.nr_pages_max	= PIPE_DEF_BUFFERS,
+		.ops		= &scull_pipe_buf_ops,
+		.spd_release	= scull_spd_release,
+	};
+	struct scull_store *store;
+	struct scull_qset *dptr;
+	void **data;
+	void *quantum_data;
+	struct page *page;
+	loff_t pos = *ppos;
+	unsigned long item;
+	unsigned long size;
+	int itemsize;
+	int quantum;
+	int s_pos;
+	int q_pos;
+	int rest;
+	size_t chunk;
+	ssize_t retval;
+	int idx;
+
+	idx = srcu_read_lock(&scull_srcu);
+	store = srcu_dereference(dev->store, &scull_srcu);
+	if (!store || !scull_page_backed(store->quantum))
+		goto copy;
+	quantum		= store->quantum;
+	itemsize	= quantum * store->qset;
+	size		= READ_ONCE(store->size);
+
+	while (len && pos < size && spd.nr_pages < PIPE_DEF_BUFFERS) {
+		item	= (long) pos / itemsize;
+		rest	= (long) pos % itemsize;
+		s_pos	= rest / quantum;
+		q_pos	= rest % quantum;
+
+		dptr	= scull_lookup(store, item);
+		data	= dptr ? srcu_dereference(dptr->data, &scull_srcu) : NULL;
+		quantum_data = data ? srcu_dereference(data[s_pos], &scull_srcu)
+				    : NULL;
+		if (quantum_data && !scull_slot_plain(quantum_data) &&
+		    quantum_data != SCULL_SLOT_ZERO)
+			break;		/* only plain pages go out as they are */
+
+		/* one page at most, like a pipe buffer */
+		chunk = min_t(size_t, len, PAGE_SIZE - offset_in_page(q_pos));
+		chunk = min_t(size_t, chunk, quantum - q_pos);
+		chunk = min_t(size_t, chunk, size - pos);
+		if (scull_slot_plain(quantum_data) && quantum_data)
+			page = virt_to_page(quantum_data + q_pos);
+		else
+			page = ZERO_PAGE(0);
+		get_page(page);
+
+		pages[spd.nr_pages]		= page;
+		partial[spd.nr_pages].offset	= offset_in_page(q_pos);
+		partial[spd.nr_pages].len	= chunk;
+		spd.nr_pages++;
+		pos += chunk;
+		len -= chunk;
+	}
+	srcu_read_unlock(&scull_srcu, idx);
+
+	if (!spd.nr_pages) {
+		if (pos >= size)
+			return 0;
+		return generic_file_splice_read(in, ppos, pipe, len, flags);
+	}
+	retval = splice_to_pipe(pipe, &spd);
+	scull_stat_inc(dev->stats, read_ops);
+	if (retval > 0) {
+		*ppos += retval;
+		scull_stat_add(dev->stats, read_bytes, retval);
+	}
+	return retval;
+
+copy:
+	srcu_read_unlock(&scull_srcu, idx);
+	return generic_file_splice_read(in, ppos, pipe, len, flags);
+}
+
+/*
+ * Space management: fallocate(). The default mode and FALLOC_FL_KEEP_SIZE
+ * allocate every quantum of the range ahead of time, so that later writes
+ * there never allocate; FALLOC_FL_ZERO_RANGE does the same and clears the
+ * range. FALLOC_FL_PUNCH_HOLE frees the quanta the range covers entirely
+ * and clears the partial ones at its edges. A range to allocate can't be
+ * larger than memory, and a fatal signal stops the work between quantum
+ * sets.
+ */
+
+static int scull_prealloc(struct scull_store *store, loff_t pos, loff_t end,
+			  int zero)
+{
+	struct scull_qset *dptr;
+	void *data;
+	int quantum	= store->quantum;
+	int itemsize	= quantum * store->qset;
+	unsigned long item;
+	int s_pos;
+	int q_pos;
+	int rest;
+	size_t chunk;
+	unsigned long last = ULONG_MAX;
+
+	while (pos < end) {
+		item	= (long) pos / itemsize;
+		rest	= (long) pos % itemsize;
+		s_pos	= rest / quantum;
+		q_pos	= rest % quantum;
+		chunk	= min_t(loff_t, end - pos, quantum - q_pos);
+
+		if (item != last) {
+			if (fatal_signal_pending(current))
+				return -EINTR;
+			cond_resched();
+			last = item;
+		}
+		dptr = scull_follow(store, item);
+		if (dptr == NULL)
+			return -ENOMEM;
+		if (down_interruptible(&dptr->sem))
+			return -ERESTARTSYS;
+		scull_dirty(store, item);
+		data = scull_fill_slot(store, dptr, s_pos);
+		if (!IS_ERR(data) && zero)
+			memset(data + q_pos, 0, chunk);
+		up(&dptr->sem);
+		if (IS_ERR(data))
+			return PTR_ERR(data);
+		pos += chunk;
+	}
+	return 0;
+}
+
+static int scull_punch_hole(struct scull_store *store, loff_t pos,
+			    loff_t end)
+{
+	struct scull_reap *reap;
+	struct scull_qset *dptr;
+	void **data;
+	int quantum	= store->quantum;
+	int itemsize	= quantum * store->qset;
+	unsigned long item;
+	int s_pos;
+	int q_pos;
+	int rest;
+	size_t chunk;
+	int err = 0;
+
+	reap = scull_reap_alloc(quantum, GFP_KERNEL);
+	if (!reap)
+		return -ENOMEM;
+
+	while (!err && pos < end) {
+		item	= (long) pos / itemsize;
+		rest	= (long) pos % itemsize;
+		s_pos	= rest / quantum;
+		q_pos	= rest % quantum;
+
+		if (!rest)
+			cond_resched();
+		dptr = scull_lookup(store, item);
+		if (dptr == NULL) {
+			pos += itemsize - rest;	/* the whole set is a hole */
+			continue;
+		}
+		chunk = min_t(loff_t, end - pos, quantum - q_pos);
+
+		down(&dptr->sem);
+		scull_dirty(store, item);
+		data = dptr->data;
+		if (data && data[s_pos]) {
+			if (chunk == quantum) {
+				scull_forget_slot(store, data[s_pos]);
+				scull_reap_add(reap, data[s_pos]);
+				rcu_assign_pointer(data[s_pos], NULL);
+				atomic_long_dec(&store->quanta);
+			} else if (data[s_pos] != SCULL_SLOT_ZERO) {
+				void *q = scull_fill_slot(store, dptr, s_pos);
+
+				if (IS_ERR(q))
+					err = PTR_ERR(q);
+				else
+					memset(q + q_pos, 0, chunk);
+			}
+		}
+		up(&dptr->sem);
+		pos += chunk;
+	}
+
+	scull_reap_free(reap);
+	return err;
+}
+
+long scull_fallocate(struct file *filp, int mode, loff_t offset, loff_t len)
+{
+	struct scull_dev *dev = filp->private_data;
+	struct scull_store *store;
+	loff_t end;
+	long retval = 0;
+
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+		     FALLOC_FL_ZERO_RANGE))
+		return -EOPNOTSUPP;
+	/* the same rules as vfs_fallocate(), for callers coming via ioctl */
+	if ((mode & FALLOC_FL_PUNCH_HOLE) &&
+	    (!(mode & FALLOC_FL_KEEP_SIZE) || (mode & FALLOC_FL_ZERO_RANGE)))
+		return -EOPNOTSUPP;
+	if (offset < 0 || len <= 0)
+		return -EINVAL;
+	if (len > MAX_LFS_FILESIZE - offset)
+		return -EFBIG;
+	end = offset + len;
+	if (!(mode & FALLOC_FL_PUNCH_HOLE) &&
+	    len > (loff_t) totalram_pages << PAGE_SHIFT)
+		return -ENOSPC;		/* could never be allocated */
+	if (!(filp->f_mode & FMODE_WRITE))
+		return -EBADF;
+
+	if (down_read_killable(&dev->sem))
+		return -ERESTARTSYS;
+	if (mode & FALLOC_FL_PUNCH_HOLE) {
+		/*
+		 * Mappings must not keep the pages freed: zap them before,
+		 * and after for those faulted in meanwhile, as
+		 * truncate_pagecache() does.
+		 */
+		store = rcu_dereference_protected(dev->store, 1);
+		if (store && atomic_read(&dev->mapped))
+			unmap_mapping_range(&dev->mapping, offset, len, 1);
+		if (store)
+			retval = scull_punch_hole(store, offset, end);
+		if (store && atomic_read(&dev->mapped))
+			unmap_mapping_range(&dev->mapping, offset, len, 1);
+		goto out;
+	}
+
+	store = scull_get_store(dev);
+	if (!store) {
+		retval = -ENOMEM;
+		goto out;
+	}
+	retval = scull_prealloc(store, offset, end,
+				mode & FALLOC_FL_ZERO_RANGE);
+	if (!retval && !(mode & FALLOC_FL_KEEP_SIZE))
+		scull_extend(store, end);
+out:
+	up_read(&dev->sem);
+	return retval;
+}
+
+/*
+ * Copying between devices. The VFS only offers copy_file_range() and
+ * clone ranges on regular files, so SCULL_IOCCOPY does the job instead.
+ * When source and destination share their quantum size and line up on
+ * quantum boundaries, whole quanta are shared by reference (see
+ * "Deduplication") rather than copied, and each side gets a copy of its own
+ * only when it writes there. Everything else, and any store that may be
+ * mapped, is copied through a bounce buffer.
+ */
+
+/*
+ * Take a reference to the contents of data[i], for another slot to share:
+ * a shared quantum, SCULL_SLOT_ZERO, or NULL for a hole. A plain quantum
+ * is made shared first. Must be called with the quantum-set semaphore held.
+ */
+static void *scull_ref_slot(struct scull_store *store, void **data, int i)
+{
+	struct scull_shared *sq;
+	void *slot = data ? data[i] : NULL;
+
+	if (!slot || slot == SCULL_SLOT_ZERO)
+		return slot;
+	if (scull_slot_zipped(slot)) {
+		slot = scull_own_slot(store, data, i);
+		if (IS_ERR(slot))
+			return slot;
+	}
+	if (scull_slot_plain(slot)) {
+		sq = kmalloc(sizeof(struct scull_shared), GFP_KERNEL);
+		if (!sq)
+			return ERR_PTR(-ENOMEM);
+		refcount_set(&sq->ref, 1);
+		sq->quantum	= store->quantum;
+		sq->data	= slot;
+		sq->hash	= 0;
+		INIT_HLIST_NODE(&sq->node);	/* not looked up by contents */
+
+		/* the memory stays, now charged to the module only */
+		atomic_long_sub(store->quantum, &store->bytes);
+		scull_node_add(store, slot, -1);
+		slot = scull_sq_slot(sq);
+		rcu_assign_pointer(data[i], slot);
+	}
+	refcount_inc(&scull_slot_sq(slot)->ref);
+	return slot;
+}
+
+/*
+ * Make the quantum of "dst" at "dst_pos" share the one of "src" at
+ * "src_pos". The two semaphores are never held together, so concurrent
+ * copies in opposite directions can't deadlock.
+ */
+static int scull_share_quantum(struct scull_store *src, loff_t src_pos,
+			       struct scull_store *dst, loff_t dst_pos,
+			       struct scull_reap *reap)
+{
+	struct scull_qset *dptr;
+	void **data;
+	void *slot = NULL;
+	void *old;
+	int quantum = src->quantum;
+	unsigned long item = (long) dst_pos / (quantum * dst->qset);
+	int err = 0;
+
+	dptr = scull_lookup(src, (long) src_pos / (quantum * src->qset));
+	if (dptr) {
+		down(&dptr->sem);
+		slot = scull_ref_slot(src, dptr->data,
+				      (long) src_pos % (quantum * src->qset) /
+				      quantum);
+		up(&dptr->sem);
+		if (IS_ERR(slot))
+			return PTR_ERR(slot);
+	}
+
+	dptr = slot ? scull_follow(dst, item) : scull_lookup(dst, item);
+	if (!dptr)
+		return slot ? -ENOMEM : 0;	/* a hole over a hole */
+
+	down(&dptr->sem);
+	scull_dirty(dst, item);
+	data = slot ? scull_fill_qset(dst, dptr) : dptr->data;
+	if (IS_ERR(data)) {
+		err = PTR_ERR(data);
+		scull_free_slot(slot, quantum);
+	} else if (data) {
+		int s_pos = (long) dst_pos % (quantum * dst->qset) / quantum;
+
+		old = data[s_pos];
+		rcu_assign_pointer(data[s_pos], slot);
+		if (old) {
+			scull_forget_slot(dst, old);
+			scull_reap_add(reap, old);
+		}
+		if (!old != !slot)
+			atomic_long_add(slot ? 1 : -1, &dst->quanta);
+	}
+	scull_touch(dptr);
+	up(&dptr->sem);
+	return err;
+}
+
+static ssize_t scull_copy_range(struct scull_dev *src, loff_t src_pos,
+				struct scull_dev *dst, loff_t dst_pos,
+				size_t len)
+{
+	struct scull_dev *first	 = min(src, dst);
+	struct scull_dev *second = max(src, dst);
+	struct scull_store *sstore;
+	struct scull_store *dstore;
+	struct scull_reap *reap = NULL;
+	struct kvec kv;
+	struct iov_iter iter;
+	void *buf = NULL;
+	loff_t spos;
+	loff_t dpos;
+	unsigned long size;
+	int quantum = 0;
+	size_t chunk;
+	ssize_t n;
+	ssize_t done = 0;
+	ssize_t err = 0;
+
+	if (src_pos < 0 || dst_pos < 0)
+		return -EINVAL;
+	len = min_t(size_t, len, MAX_RW_COUNT);
+	if (src == dst && src_pos < dst_pos + (loff_t) len &&
+	    dst_pos < src_pos + (loff_t) len)
+		return -EINVAL;		/* overlapping */
+
+	/* always in the same order, as they are both taken shared */
+	if (down_read_killable(&first->sem))
+		return -ERESTARTSYS;
+	if (second != first && down_read_killable(&second->sem)) {
+		up_read(&first->sem);
+		return -ERESTARTSYS;
+	}
+
+	sstore = rcu_dereference_protected(src->store, 1);
+	size = sstore ? sstore->size : 0;
+	if (src_pos >= size)
+		goto out;
+	len = min_t(loff_t, len, size - src_pos);
+	dstore = scull_get_store(dst);
+	if (!dstore) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	if (sstore->quantum == dstore->quantum &&
+	    !scull_page_backed(sstore->quantum) &&
+	    src_pos % sstore->quantum == dst_pos % dstore->quantum) {
+		quantum = sstore->quantum;
+		reap = scull_reap_alloc(quantum, GFP_KERNEL);
+		if (!reap)
+			quantum = 0;	/* copy, then */
+	}
+
+	while (done < len) {
+		if (quantum && (src_pos + done) % quantum == 0 &&
+		    len - done >= quantum) {
+			err = scull_share_quantum(sstore, src_pos + done,
+						  dstore, dst_pos + done, reap);
+			if (err)
+				break;
+			done += quantum;
+			scull_extend(dstore, dst_pos + done);
+			continue;
+		}
+
+		/* up to the next quantum boundary, a page at most */
+		chunk = min_t(size_t, len - done, PAGE_SIZE);
+		if (quantum)
+			chunk = min_t(size_t, chunk,
+				      quantum - (src_pos + done) % quantum);
+		if (!buf) {
+			buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+			if (!buf) {
+				err = -ENOMEM;
+				break;
+			}
+		}
+		kv.iov_base = buf;
+		kv.iov_len  = chunk;
+		iov_iter_kvec(&iter, READ, &kv, 1, chunk);
+		spos = src_pos + done;
+		n = scull_do_read(src, &iter, &spos);
+		if (n <= 0) {
+			err = n;
+			break;
+		}
+		iov_iter_kvec(&iter, WRITE, &kv, 1, n);
+		dpos = dst_pos + done;
+		n = scull_store_write(dstore, &iter, &dpos);
+		if (n <= 0) {
+			err = n;
+			break;
 		}
-		next = dptr->next;
-		kfree(dptr);
+		done += n;
 	}
-	dev->size    = 0;
-	dev->quantum = scull_quantum;
-	dev->qset     = scull_qset;
-	dev->data    = NULL;
-	return 0;
-}
 
-#ifdef SCULL_DEBUG	/* use proc only if debugging */
+out:
+	if (second != first)
+		up_read(&second->sem);
+	up_read(&first->sem);
+	if (reap)
+		scull_reap_free(reap);
+	kfree(buf);
+	return done ? done : err;
+}
 
 /*
- * /proc_fs stuff
- * using the seq_file interface
+ * Re-layout. Each device can have a geometry of its own; when it changes
+ * while the device holds data, a work item copies the data into a new
+ * store of the new geometry, with the device in use. Quantum sets written
+ * in the meantime are tagged (see scull_dirty()) and copied again with
+ * the device semaphore held for writing, just before the new store takes
+ * the place of the old one. Mapped devices keep their geometry.
  */
 
 /*
- * Here are the sequence iteration methods. Our "position" is simply the
- * device number.
+ * Copy quantum set "item" of "old" into "new", at the same offsets. Quanta
+ * of zeros become holes. "buf" is a scratch quantum for compressed data.
  */
-static void *scull_seq_start(struct seq_file *s, loff_t *pos)
-{
-	if (*pos >= scull_nr_devs)
-		return NULL;		/* No more to read */
-	return (void *)(scull_devices + *pos);
-}
-
-static void *scull_seq_next(struct seq_file *s, void *v, loff_t *pos)
+static int scull_relayout_qset(struct scull_store *old, unsigned long item,
+			       struct scull_store *new, void *buf)
 {
-	(*pos)++;
-	if (*pos >= scull_nr_devs)
-		return NULL;
-	return scull_devices + *pos;
-}
+	struct scull_qset *dptr = scull_lookup(old, item);
+	struct kvec kv;
+	struct iov_iter iter;
+	void *slot;
+	loff_t pos;
+	ssize_t n;
+	int err = 0;
+	int i;
 
-static void scull_seq_stop(struct seq_file *s, void *v)
-{
-	/* There's actually nothing to do here */
+	if (!dptr)
+		return 0;
+	down(&dptr->sem);
+	for (i = 0; dptr->data && i < old->qset; i++) {
+		slot = dptr->data[i];
+		if (!slot || slot == SCULL_SLOT_ZERO)
+			continue;
+		if (scull_slot_shared(slot)) {
+			slot = scull_slot_sq(slot)->data;
+		} else if (scull_slot_zipped(slot)) {
+			err = scull_unzip(scull_slot_zq(slot), buf, old->quantum);
+			if (err)
+				break;
+			slot = buf;
+		}
+		kv.iov_base = slot;
+		kv.iov_len  = old->quantum;
+		iov_iter_kvec(&iter, WRITE, &kv, 1, old->quantum);
+		pos = ((loff_t) item * old->qset + i) * old->quantum;
+		n = scull_store_write(new, &iter, &pos);
+		if (n < old->quantum) {
+			err = n < 0 ? n : -ENOMEM;
+			break;
+		}
+	}
+	up(&dptr->sem);
+	return err;
 }
 
-static int scull_seq_show(struct seq_file *s, void *v)
+static void scull_relayout_work(struct work_struct *work)
 {
-	struct scull_dev *dev = (struct scull_dev *) v;
-	struct scull_qset *d;
-	int i;
+	struct scull_dev *dev = container_of(work, struct scull_dev,
+					     relayout_work);
+	struct scull_store *old;
+	struct scull_store *new = NULL;
+	struct radix_tree_iter iter;
+	void **slot;
+	void *buf = NULL;
+	loff_t start;
+	int err = -ENOMEM;
+
+	/* first pass: copy everything, with the device in use */
+	down_read(&dev->sem);
+	old = rcu_dereference_protected(dev->store, 1);
+	if (!old || (old->quantum == dev->quantum && old->qset == dev->qset)) {
+		up_read(&dev->sem);
+		return;
+	}
+	new = scull_alloc_store(dev);
+	buf = kmalloc(old->quantum, GFP_KERNEL);
+	if (!new || !buf) {
+		up_read(&dev->sem);
+		goto fail;
+	}
+	/*
+	 * From here on every page dirtied through a mapping goes through
+	 * mkwrite, which tags it; pages a mapping already had writable
+	 * would not, so none may be there when we start.
+	 */
+	WRITE_ONCE(old->relayout, 1);
+	smp_mb();
+	if (atomic_read(&dev->mapped)) {
+		WRITE_ONCE(old->relayout, 0);
+		up_read(&dev->sem);
+		err = -EBUSY;
+		goto fail;
+	}
+	rcu_read_lock();
+	radix_tree_for_each_slot(slot, &old->index, &iter, 0) {
+		slot = radix_tree_iter_resume(slot, &iter);
+		rcu_read_unlock();
+		err = scull_relayout_qset(old, iter.index, new, buf);
+		cond_resched();
+		rcu_read_lock();
+		if (err)
+			break;
+	}
+	rcu_read_unlock();
+	up_read(&dev->sem);
+	if (err)
+		goto fail;
 
-	if (down_interruptible(&dev->sem))
-		return -ERESTARTSYS;
-	seq_printf(s, "\nDevice %i: qset %i, q %i, sz %li\n",
-		       (int) (dev - scull_devices), dev->qset, dev->quantum,
-		       dev->size);
-
-	for (d = dev->data; d; d = d->next) {	/* scan the list */
-		seq_printf(s, " item at %p, qset at %p\n", d, d->data);
-		if(d->data && !d->next)		/* dump only last item */
-			for (i = 0; i < dev->qset; i++) {
-				if (d->data[i])
-					seq_printf(s, "	  % 4i: %8p\n", i,
-							d->data[i]);
-			}
+	/* second pass: what was written meanwhile, with the device to us */
+	down_write(&dev->sem);
+	err = -EBUSY;
+	if (rcu_dereference_protected(dev->store, 1) != old ||
+	    atomic_read(&dev->mapped))
+		goto fail_locked;	/* trimmed, or mapped meanwhile */
+	radix_tree_for_each_tagged(slot, &old->index, &iter, 0,
+				   SCULL_TAG_DIRTY) {
+		start = (loff_t) iter.index * old->quantum * old->qset;
+		err = scull_punch_hole(new, start,
+				       start + (loff_t) old->quantum * old->qset);
+		if (!err)
+			err = scull_relayout_qset(old, iter.index, new, buf);
+		if (err)
+			goto fail_locked;
 	}
-	up(&dev->sem);
-	return 0;
+	new->size = old->size;
+	rcu_assign_pointer(dev->store, new);
+	INIT_WORK(&old->free_work, scull_free_store_work);
+	queue_work(scull_wq, &old->free_work);
+
+	/* the geometry may have changed again meanwhile */
+	if (new->quantum != dev->quantum || new->qset != dev->qset)
+		queue_work(scull_wq, &dev->relayout_work);
+	up_write(&dev->sem);
+	kfree(buf);
+	return;
+
+fail_locked:
+	WRITE_ONCE(old->relayout, 0);
+	up_write(&dev->sem);
+fail:
+	printk(KERN_NOTICE "scull: re-layout failed (%i), keeping "
+	       "quantum %i qset %i until the next trim\n",
+	       err, old->quantum, old->qset);
+	if (new)
+		scull_free_store(new);	/* never published */
+	kfree(buf);
 }
 
 /*
- * Connect the "iterator" methods with the seq_ops structure
+ * Whether a device may have this geometry, through ioctl or the control
+ * device: quanta and quantum-set arrays must each fit in one allocation,
+ * and the bytes of a quantum set in an int.
  */
-static struct seq_operations scull_seq_ops = {
-	.start	= scull_seq_start,
-	.next	= scull_seq_next,
-	.stop	= scull_seq_stop,
-	.show	= scull_seq_show
-};
+#define SCULL_QUANTUM_MAX	KMALLOC_MAX_SIZE
+#define SCULL_QSET_MAX		(KMALLOC_MAX_SIZE / sizeof(void *))
 
-/*
- * Now to implement the /proc file we need only make an `open` method which
- * sets up the sequence operators.
- */
-static int scull_proc_open(struct inode *inode, struct file *file)
+int scull_geometry_ok(int quantum, int qset)
 {
-	return seq_open(file, &scull_seq_ops);
+	return quantum > 0 && qset > 0 && quantum <= SCULL_QUANTUM_MAX &&
+	       qset <= SCULL_QSET_MAX && quantum <= INT_MAX / qset;
 }
 
 /*
- * Create a fops structure for the /proc file. Required by the seq_file
- * interface. We only need to worry about the open() method, however. :-)
+ * Give a device a geometry of its own, which outlives trims. Data already
+ * there is re-laid out in the background.
  */
-static struct file_operations scull_proc_ops = {
-	.owner	 = THIS_MODULE,
-	.open	 = scull_proc_open,
-	.read	 = seq_read,
-	.llseek  = seq_lseek,
-	.release = seq_release
-};
-
-static void scull_create_proc(void)
+static int scull_set_geometry(struct scull_dev *dev, int quantum, int qset)
 {
-	struct proc_dir_entry *entry;
-	entry = proc_create_data("scullseq", 0, NULL, &scull_proc_ops, NULL);
-}
+	struct scull_store *store;
+	int retval = 0;
 
-static void scull_remove_proc(void)
-{
-	remove_proc_entry("scullseq", NULL);
+	if (down_write_killable(&dev->sem))
+		return -ERESTARTSYS;
+	store = rcu_dereference_protected(dev->store, 1);
+	if (store && atomic_read(&dev->mapped) &&
+	    (store->quantum != quantum || store->qset != qset)) {
+		retval = -EBUSY;
+		goto out;
+	}
+	dev->quantum		= quantum;
+	dev->qset		= qset;
+	dev->own_geometry	= 1;
+	if (store && (store->quantum != quantum || store->qset != qset))
+		queue_work(scull_wq, &dev->relayout_work);
+out:
+	up_write(&dev->sem);
+	return retval;
 }
 
-#endif	/* SCULL_DEBUG */
-
-
 /*
- * open and close
+ * The NUMA policy of one device (see "NUMA placement"). It applies to the
+ * quanta allocated from now on; those in place stay where they are.
  */
-int scull_open(struct inode *inode, struct file *filp)
+static int scull_set_numa(struct scull_dev *dev, int policy, int node)
 {
-	struct scull_dev *dev;		/* device information */
+	struct scull_store *store;
 
-	dev = container_of(inode->i_cdev, struct scull_dev, cdev);
-	filp->private_data = dev;	/* store dev for quick access in future */
+	if (policy == SCULL_NUMA_NODE) {
+		if (node < 0 || node >= nr_node_ids ||
+		    !node_state(node, N_MEMORY))
+			return -EINVAL;
+	} else if (policy == SCULL_NUMA_LOCAL ||
+		   policy == SCULL_NUMA_INTERLEAVE) {
+		node = NUMA_NO_NODE;
+	} else {
+		return -EINVAL;
+	}
 
-	/* Now trim to 0 the length of the device if open was write-only */
-	if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
-		if (down_interruptible(&dev->sem))
-			return -ERESTARTSYS;
-		scull_trim(dev);	/* ignore errors */
-		up(&dev->sem);
+	if (down_write_killable(&dev->sem))
+		return -ERESTARTSYS;
+	dev->numa = policy;
+	dev->node = node;
+	store = rcu_dereference_protected(dev->store, 1);
+	if (store) {
+		WRITE_ONCE(store->node, node);
+		WRITE_ONCE(store->numa, policy);
 	}
+	up_write(&dev->sem);
 	return 0;
 }
 
-int scull_release(struct inode *inode, struct file *filp)
+/*
+ * Batched positional I/O: many pread()/pwrite() at once, with the device
+ * semaphore taken only once and the operations run in offset order, so the
+ * index is walked from one end to the other. Each gets its own result.
+ */
+#define SCULL_BATCH_MAX	1024
+
+static int scull_io_cmp(const void *a, const void *b)
 {
-	return 0;
+	const struct scull_io *x = *(const struct scull_io **) a;
+	const struct scull_io *y = *(const struct scull_io **) b;
+
+	if (x->offset != y->offset)
+		return x->offset < y->offset ? -1 : 1;
+	return x < y ? -1 : x > y;	/* keep the submission order */
 }
 
-/*
- * Follow the list
- */
-struct scull_qset *scull_follow(struct scull_dev *dev, int n)
+static long scull_batch(struct file *filp, struct scull_batch __user *ubatch)
 {
-	struct scull_qset *qs = dev->data;
+	struct scull_dev *dev = filp->private_data;
+	struct scull_batch batch;
+	struct scull_store *store;
+	struct scull_io *ios;
+	struct scull_io **order;
+	struct scull_io *io;
+	struct iovec iov;
+	struct iov_iter iter;
+	loff_t pos;
+	long retval = 0;
+	int idx;
+	int i;
 
-	/* Allocate first qset explicitly if need be */
-	if (!qs) {
-		qs = dev->data = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-		if (qs == NULL)
-			return NULL;	/* Never mind */
-		memset(qs, 0, sizeof(struct scull_qset));
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+	if (batch.nr <= 0 || batch.nr > SCULL_BATCH_MAX)
+		return -EINVAL;
+	ios   = kvmalloc_array(batch.nr, sizeof(*ios), GFP_KERNEL);
+	order = kvmalloc_array(batch.nr, sizeof(*order), GFP_KERNEL);
+	if (!ios || !order) {
+		retval = -ENOMEM;
+		goto out;
+	}
+	if (copy_from_user(ios, u64_to_user_ptr(batch.ios),
+			   batch.nr * sizeof(*ios))) {
+		retval = -EFAULT;
+		goto out;
 	}
+	for (i = 0; i < batch.nr; i++)
+		order[i] = ios + i;
+	sort(order, batch.nr, sizeof(*order), scull_io_cmp, NULL);
 
-	/* Then follow the list */
-	while (n--) {
-		if (!qs->next) {
-			qs->next = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-			if (qs->next == NULL)
-				return NULL;
-			memset(qs->next, 0, sizeof(struct scull_qset));
+	if (down_read_killable(&dev->sem)) {
+		retval = -ERESTARTSYS;
+		goto out;
+	}
+	/* the store can't go while we hold the semaphore; its quanta can */
+	store = rcu_dereference_protected(dev->store, 1);
+	for (i = 0; i < batch.nr; i++) {
+		io = order[i];
+		pos = io->offset;
+		if (pos < 0 || io->len < 0) {
+			io->result = -EINVAL;
+			continue;
+		}
+		switch (io->op) {
+		case SCULL_IO_READ:
+			io->result = -EBADF;
+			if (!(filp->f_mode & FMODE_READ))
+				break;
+			io->result = import_single_range(READ,
+					u64_to_user_ptr(io->buf),
+					io->len, &iov, &iter);
+			if (!io->result && store) {
+				idx = srcu_read_lock(&scull_srcu);
+				io->result = scull_store_read(store, &iter,
+							      &pos);
+				srcu_read_unlock(&scull_srcu, idx);
+			}
+			scull_stat_inc(dev->stats, read_ops);
+			if (io->result > 0)
+				scull_stat_add(dev->stats, read_bytes,
+					       io->result);
+			break;
+		case SCULL_IO_WRITE:
+			io->result = -EBADF;
+			if (!(filp->f_mode & FMODE_WRITE))
+				break;
+			if (!store)
+				store = scull_get_store(dev);
+			io->result = -ENOMEM;
+			if (!store)
+				break;
+			io->result = import_single_range(WRITE,
+					u64_to_user_ptr(io->buf),
+					io->len, &iov, &iter);
+			if (!io->result)
+				io->result = scull_store_write(store, &iter,
+							       &pos);
+			scull_stat_inc(dev->stats, write_ops);
+			if (io->result > 0)
+				scull_stat_add(dev->stats, write_bytes,
+					       io->result);
+			break;
+		default:
+			io->result = -EINVAL;
 		}
-		qs = qs->next;
-		continue;
 	}
-	return qs;
+	up_read(&dev->sem);
+
+	if (copy_to_user(u64_to_user_ptr(batch.ios), ios,
+			 batch.nr * sizeof(*ios)))
+		retval = -EFAULT;
+out:
+	kvfree(order);
+	kvfree(ios);
+	return retval;
 }
 
 /*
- * Data Management: read and write
- *
- * Each invocation of `scull_read` deals only with a single data quantum,
- * without implementing a loop to gather all the data. If the reading program
- * really wants more data, it reiterates the call.
+ * Snapshots. The data of a bare device can be saved to a regular file and
+ * loaded back from it, through ioctl() or, with scull_image_dir set, on
+ * unload and load. An image is a struct scull_image, then at offset
+ * "index" the numbers of the quanta it holds in increasing order, then at
+ * offset "data" the quanta themselves, each on a SCULL_IMAGE_ALIGN
+ * boundary. Holes, quanta written whole as zeros (SCULL_SLOT_ZERO) and
+ * quanta wholly past the end are left out; any other quantum goes in,
+ * zeros or not.
  */
+#define SCULL_IMAGE_ALIGN	4096
 
-ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
-		   loff_t *f_pos)
+static int scull_image_write(struct file *file, const void *buf, size_t len,
+			     loff_t pos)
 {
-	struct scull_qset *dptr;	/* the first listitem */
-	struct scull_dev *dev = filp->private_data;
-	int item;
-	int s_pos;
-	int q_pos;
-	int rest;
-	int quantum	= dev->quantum;
-	int qset	= dev->qset;
-	int itemsize	= quantum * qset;
-	ssize_t retval	= 0;
+	ssize_t n = kernel_write(file, buf, len, &pos);
 
-	if (down_interruptible(&dev->sem))
-		return -ERESTARTSYS;
-	if (*f_pos >= dev->size)
-		goto out;
-	if (*f_pos + count > dev->size)
-		count = dev->size - *f_pos;
+	if (n < 0)
+		return n;
+	return n == len ? 0 : -EIO;
+}
 
-	/* find listitem, qset, index, and offset in the quantum */
-	item = (long) *f_pos / itemsize;
-	rest = (long) *f_pos % itemsize;
-	s_pos	= rest / quantum;
-	q_pos	= rest % quantum;
+static int scull_image_read(struct file *file, void *buf, size_t len,
+			    loff_t pos)
+{
+	ssize_t n = kernel_read(file, buf, len, &pos);
 
-	/* follow the list up to the right position */
-	dptr	= scull_follow(dev, item);
+	if (n < 0)
+		return n;
+	return n == len ? 0 : -EIO;	/* a truncated image */
+}
 
-	if (dptr == NULL || !dptr->data || !dptr->data[s_pos])
-		goto out;	/* don't fill holes */
+/*
+ * Write quantum "n" of the store at "pos". The scan worker may have
+ * changed its slot meanwhile, so it is looked at under its semaphore.
+ */
+static int scull_snapshot_quantum(struct scull_store *store, u64 n,
+				  void *buf, struct file *file, loff_t pos)
+{
+	struct scull_qset *dptr = scull_lookup(store, div_u64(n, store->qset));
+	const void *from = buf;
+	void *slot;
+	int err = 0;
+
+	down(&dptr->sem);
+	slot = dptr->data[do_div(n, store->qset)];
+	if (!slot || slot == SCULL_SLOT_ZERO)
+		memset(buf, 0, store->quantum);
+	else if (scull_slot_zipped(slot))
+		err = scull_unzip(scull_slot_zq(slot), buf, store->quantum);
+	else if (scull_slot_shared(slot))
+		from = scull_slot_sq(slot)->data;
+	else
+		from = slot;
+	if (!err)
+		err = scull_image_write(file, from, store->quantum, pos);
+	up(&dptr->sem);
+	return err;
+}
 
-	/* read only up to the end of this quantum */
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
+/*
+ * Save the device to "file". Writers wait until it's done; readers don't.
+ */
+static int scull_snapshot(struct scull_dev *dev, struct file *file)
+{
+	struct scull_image img = {
+		.magic		= SCULL_IMAGE_MAGIC,
+		.version	= SCULL_IMAGE_VERSION,
+	};
+	struct scull_store *store;
+	struct scull_qset *dptr;
+	struct radix_tree_iter iter;
+	void **rslot;
+	void *slot;
+	u64 *index = NULL;
+	u64 n;
+	void *buf = NULL;
+	unsigned long max = 0;
+	unsigned long nr = 0;
+	unsigned long k;
+	u64 limit = 0;
+	loff_t stride;
+	loff_t end;
+	int err = 0;
+	int i;
 
-	if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
-		retval = -EFAULT;
-		goto out;
+	if (down_write_killable(&dev->sem))
+		return -ERESTARTSYS;
+	store = rcu_dereference_protected(dev->store, 1);
+	img.quantum	= store ? store->quantum : dev->quantum;
+	img.qset	= store ? store->qset : dev->qset;
+	img.size	= store ? store->size : 0;
+
+	/* the slots in use are counted: that's all the index can need */
+	if (store) {
+		max = atomic_long_read(&store->quanta);
+		limit = div_u64(img.size + img.quantum - 1, img.quantum);
 	}
-	*f_pos	+= count;
+	if (max) {
+		index = kvmalloc_array(max, sizeof(u64), GFP_KERNEL);
+		buf = kvmalloc(store->quantum, GFP_KERNEL);
+		if (!index || !buf) {
+			err = -ENOMEM;
+			goto out;
+		}
+		radix_tree_for_each_slot(rslot, &store->index, &iter, 0) {
+			dptr = radix_tree_deref_slot(rslot);
+			for (i = 0; dptr->data && i < store->qset; i++) {
+				slot = READ_ONCE(dptr->data[i]);
+				n = (u64) iter.index * store->qset + i;
+				if (slot && slot != SCULL_SLOT_ZERO &&
+				    n < limit && nr < max)
+					index[nr++] = n;
+			}
+		}
+	}
+
+	img.nr		= nr;
+	img.index	= SCULL_IMAGE_ALIGN;
+	img.data	= round_up(img.index + nr * sizeof(u64),
+				   SCULL_IMAGE_ALIGN);
+	stride		= round_up(img.quantum, SCULL_IMAGE_ALIGN);
+	for (k = 0; !err && k < nr; k++)
+		err = scull_snapshot_quantum(store, index[k], buf, file,
+					     img.data + k * stride);
+	if (!err && nr)
+		err = scull_image_write(file, index, nr * sizeof(u64),
+					img.index);
+	/* the header goes last: an image cut short has none */
+	if (!err)
+		err = scull_image_write(file, &img, sizeof(img), 0);
+	end = nr ? img.data + (nr - 1) * stride + img.quantum : img.data;
+	if (!err)
+		err = vfs_truncate(&file->f_path, end);
+	if (!err)
+		err = vfs_fsync(file, 0);
 
 out:
-	up(&dev->sem);
-	return retval;
+	up_write(&dev->sem);
+	kvfree(buf);
+	kvfree(index);
+	return err;
 }
 
-ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
-		    loff_t *f_pos)
+/*
+ * Replace the data of the device with the image in "file". The new data
+ * is built aside and published at once, with the geometry of the image.
+ */
+static int scull_restore(struct scull_dev *dev, struct file *file)
 {
-	struct scull_dev *dev = filp->private_data;
+	struct scull_image img;
+	struct scull_store *store = NULL;
 	struct scull_qset *dptr;
-	int quantum	= dev->quantum;
-	int qset	= dev->qset;
-	int itemsize	= quantum * qset;
-	int item;
-	int s_pos;
-	int q_pos;
-	int rest;
-	ssize_t retval	= -ENOMEM;	/* value used in "goto out" statements */
-
-	if (down_interruptible(&dev->sem))
-		return -ERESTARTSYS;
+	u64 *index = NULL;
+	u64 limit;
+	void *data;
+	loff_t stride;
+	unsigned long k;
+	int err;
 
-	/* find listitem, q_set, index and offset in the quantum */
-	item	= (long) *f_pos / itemsize;
-	rest	= (long) *f_pos % itemsize;
-	s_pos	= rest / quantum;
-	q_pos	= rest % quantum;
+	err = scull_image_read(file, &img, sizeof(img), 0);
+	if (err)
+		return err;
+	if (img.magic != SCULL_IMAGE_MAGIC ||
+	    img.version != SCULL_IMAGE_VERSION ||
+	    img.quantum <= 0 || img.qset <= 0 ||
+	    img.quantum > INT_MAX / img.qset || img.size > LLONG_MAX)
+		return -EINVAL;
+	limit = div_u64(img.size + img.quantum - 1, img.quantum);
+	if (img.nr > limit || img.nr > ULONG_MAX / sizeof(u64))
+		return -EINVAL;
+	stride = round_up(img.quantum, SCULL_IMAGE_ALIGN);
+
+	if (img.nr) {
+		index = kvmalloc_array(img.nr, sizeof(u64), GFP_KERNEL);
+		if (!index)
+			return -ENOMEM;
+		err = scull_image_read(file, index, img.nr * sizeof(u64),
+				       img.index);
+		if (err)
+			goto out;
+		for (k = 0; k < img.nr; k++)
+			if (index[k] >= limit || (k && index[k] <= index[k - 1])) {
+				err = -EINVAL;
+				goto out;
+			}
+	}
 
-	/* follow the list up to the right position */
-	dptr = scull_follow(dev, item);
-	if (dptr == NULL)
+	if (down_write_killable(&dev->sem)) {
+		err = -ERESTARTSYS;
 		goto out;
-	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(char *), GFP_KERNEL);
-		if (!dptr->data)
-			goto out;
-		memset(dptr->data, 0, qset * sizeof(char *));
 	}
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
-		if (!dptr->data[s_pos])
-			goto out;
+	if (atomic_read(&dev->mapped)) {
+		err = -EBUSY;	/* the mappings pin the old data */
+		goto unlock;
 	}
+	store = scull_alloc_store(dev);
+	if (!store) {
+		err = -ENOMEM;
+		goto unlock;
+	}
+	store->quantum	= img.quantum;
+	store->qset	= img.qset;
 
-	/* write only upto the end of this quantum */
-	if (count > (quantum - q_pos))
-		count = quantum - q_pos;
+	/* nobody else sees this store yet: no quantum-set semaphores */
+	for (k = 0; !err && k < img.nr; k++) {
+		u64 n = index[k];
 
-	if (copy_from_user((dptr->data[s_pos] + q_pos), buf, count)) {
-		retval = -EFAULT;
-		goto out;
+		dptr = scull_follow(store, div_u64(n, img.qset));
+		if (!dptr) {
+			err = -ENOMEM;
+			break;
+		}
+		data = scull_fill_slot(store, dptr, do_div(n, img.qset));
+		if (IS_ERR(data))
+			err = PTR_ERR(data);
+		else
+			err = scull_image_read(file, data, img.quantum,
+					       img.data + k * stride);
+	}
+	if (err) {
+		scull_free_store(store);
+		goto unlock;
 	}
-	*f_pos += count;
-	retval = count;
+	store->size = img.size;
 
-	/* update the size */
-	if (dev->size < *f_pos)
-		dev->size = *f_pos;
+	scull_trim(dev);
+	dev->quantum	= img.quantum;
+	dev->qset	= img.qset;
+	if (img.quantum != scull_quantum || img.qset != scull_qset)
+		dev->own_geometry = 1;
+	rcu_assign_pointer(dev->store, store);
 
+unlock:
+	up_write(&dev->sem);
 out:
-	up(&dev->sem);
-	return retval;
+	kvfree(index);
+	return err;
+}
+
+/*
+ * Rename "from" over "to", both in scull_image_dir.
+ */
+static int scull_image_rename(const char *from, const char *to)
+{
+	struct path dir;
+	struct dentry *old;
+	struct dentry *new;
+	int err;
+
+	err = kern_path(scull_image_dir, LOOKUP_DIRECTORY, &dir);
+	if (err)
+		return err;
+	err = mnt_want_write(dir.mnt);
+	if (err)
+		goto out;
+	lock_rename(dir.dentry, dir.dentry);
+	old = lookup_one_len(from, dir.dentry, strlen(from));
+	if (IS_ERR(old)) {
+		err = PTR_ERR(old);
+		goto unlock;
+	}
+	new = lookup_one_len(to, dir.dentry, strlen(to));
+	if (IS_ERR(new)) {
+		err = PTR_ERR(new);
+		goto put_old;
+	}
+	if (d_really_is_negative(old))
+		err = -ENOENT;
+	else
+		err = vfs_rename(d_inode(dir.dentry), old,
+				 d_inode(dir.dentry), new, NULL, 0);
+	dput(new);
+put_old:
+	dput(old);
+unlock:
+	unlock_rename(dir.dentry, dir.dentry);
+	mnt_drop_write(dir.mnt);
+out:
+	path_put(&dir);
+	return err;
+}
+
+/*
+ * With scull_image_dir set, the bare devices are saved on unload and
+ * loaded back on load, from <dir>/scull<n>.img. A device is saved to
+ * scull<n>.img.tmp first, which only takes the place of the old image
+ * once complete: an unload cut short leaves the last good image behind.
+ */
+static void scull_images(int save)
+{
+	struct file *file;
+	char name[32];
+	char tmp[36];
+	char *path;
+	int err;
+	int i;
+
+	if (!scull_image_dir || !*scull_image_dir)
+		return;
+	for (i = 0; i < scull_nr_devs; i++) {
+		snprintf(name, sizeof(name), "scull%d.img", i);
+		snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+		path = kasprintf(GFP_KERNEL, "%s/%s", scull_image_dir,
+				 save ? tmp : name);
+		if (!path)
+			return;
+		if (save)
+			file = filp_open(path, O_WRONLY | O_CREAT | O_TRUNC |
+					 O_LARGEFILE, 0600);
+		else
+			file = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+		if (IS_ERR(file)) {
+			err = PTR_ERR(file);
+		} else {
+			err = save ? scull_snapshot(scull_devices + i, file) :
+				     scull_restore(scull_devices + i, file);
+			filp_close(file, NULL);
+		}
+		if (!err && save)
+			err = scull_image_rename(tmp, name);
+		if (err && !(err == -ENOENT && !save))
+			printk(KERN_NOTICE "scull: can't %s %s: error %d\n",
+			       save ? "save to" : "load from", path, err);
+		kfree(path);
+	}
 }
 
 /*
  * The ioctl() implementation
  */
 
+/*
+ * The pipe devices share this ioctl method: the commands that work on the
+ * data of a bare device make sure they have one.
+ */
+static struct scull_dev *scull_ioctl_dev(struct file *filp)
+{
+	if (filp->f_op->llseek != scull_llseek)
+		return NULL;
+	return filp->private_data;
+}
+
 long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
+	struct scull_falloc fa;
+	struct scull_copy cp;
+	struct scull_geometry geo;
+	struct scull_numa numa;
+	struct scull_dev *dev;
+	struct fd src;
+	long ret;
 	int tmp;
 	int err	   = 0;
 	int retval = 0;
@@ -449,6 +2125,171 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		case SCULL_P_IOCQSIZE:
 			return scull_p_buffer;
 
+			/*
+			 * The VFS refuses fallocate() on character devices,
+			 * so the same operation is offered here.
+			 */
+		case SCULL_IOCFALLOCATE:
+			if (!scull_ioctl_dev(filp))
+				return -ENOTTY;
+			if (copy_from_user(&fa, (void __user *) arg, sizeof(fa)))
+				return -EFAULT;
+			return scull_fallocate(filp, fa.mode, fa.offset, fa.len);
+
+			/*
+			 * Compression of cold quanta is switched per device.
+			 */
+		case SCULL_IOCTZIP:
+			dev = scull_ioctl_dev(filp);
+			if (!dev)
+				return -ENOTTY;
+			if (!capable(CAP_SYS_ADMIN))
+				return -EPERM;
+			if (arg && !scull_zip_tfm)
+				return -EOPNOTSUPP;
+			tmp = dev->zip;
+			WRITE_ONCE(dev->zip, arg != 0);
+			if (arg)	/* a no-op if already queued */
+				queue_delayed_work(scull_wq, &dev->scan_work,
+						   scull_zip_age * HZ);
+			return tmp;
+
+		case SCULL_IOCQZIP:
+			dev = scull_ioctl_dev(filp);
+			if (!dev)
+				return -ENOTTY;
+			return dev->zip;
+
+		case SCULL_IOCTDEDUP:
+			dev = scull_ioctl_dev(filp);
+			if (!dev)
+				return -ENOTTY;
+			if (!capable(CAP_SYS_ADMIN))
+				return -EPERM;
+			tmp = dev->dedup;
+			WRITE_ONCE(dev->dedup, arg != 0);
+			if (arg)
+				queue_delayed_work(scull_wq, &dev->scan_work,
+						   scull_zip_age * HZ);
+			return tmp;
+
+		case SCULL_IOCQDEDUP:
+			dev = scull_ioctl_dev(filp);
+			if (!dev)
+				return -ENOTTY;
+			return dev->dedup;
+
+			/*
+			 * Copy a range of another device (or of this one)
+			 * into this one, sharing whole quanta where it can.
+			 */
+		case SCULL_IOCCOPY:
+			dev = scull_ioctl_dev(filp);
+			if (!dev)
+				return -ENOTTY;
+			if (!(filp->f_mode & FMODE_WRITE))
+				return -EBADF;
+			if (copy_from_user(&cp, (void __user *) arg, sizeof(cp)))
+				return -EFAULT;
+			if (cp.len < 0)
+				return -EINVAL;
+			src = fdget(cp.src_fd);
+			if (!src.file)
+				return -EBADF;
+			if (!(src.file->f_mode & FMODE_READ))
+				ret = -EBADF;
+			else if (!scull_ioctl_dev(src.file))
+				ret = -EINVAL;
+			else
+				ret = scull_copy_range(scull_ioctl_dev(src.file),
+						       cp.src_offset, dev,
+						       cp.dst_offset, cp.len);
+			fdput(src);
+			return ret;
+
+			/*
+			 * The geometry of one device, rather than the default
+			 * for all of them.
+			 */
+		case SCULL_IOCSGEOMETRY:
+			dev = scull_ioctl_dev(filp);
+			if (!dev)
+				return -ENOTTY;
+			if (!capable(CAP_SYS_ADMIN))
+				return -EPERM;
+			if (!(filp->f_mode & FMODE_WRITE))
+				return -EBADF;
+			if (copy_from_user(&geo, (void __user *) arg,
+					   sizeof(geo)))
+				return -EFAULT;
+			if (!scull_geometry_ok(geo.quantum, geo.qset))
+				return -EINVAL;
+			return scull_set_geometry(dev, geo.quantum, geo.qset);
+
+		case SCULL_IOCGGEOMETRY:
+			dev = scull_ioctl_dev(filp);
+			if (!dev)
+				return -ENOTTY;
+			geo.quantum	= dev->quantum;
+			geo.qset	= dev->qset;
+			if (copy_to_user((void __user *) arg, &geo, sizeof(geo)))
+				return -EFAULT;
+			return 0;
+
+		case SCULL_IOCBATCH:
+			if (!scull_ioctl_dev(filp))
+				return -ENOTTY;
+			return scull_batch(filp, (void __user *) arg);
+
+			/*
+			 * Where the new quanta of one device go.
+			 */
+		case SCULL_IOCSNUMA:
+			dev = scull_ioctl_dev(filp);
+			if (!dev)
+				return -ENOTTY;
+			if (!(filp->f_mode & FMODE_WRITE))
+				return -EBADF;
+			if (copy_from_user(&numa, (void __user *) arg,
+					   sizeof(numa)))
+				return -EFAULT;
+			return scull_set_numa(dev, numa.policy, numa.node);
+
+		case SCULL_IOCGNUMA:
+			dev = scull_ioctl_dev(filp);
+			if (!dev)
+				return -ENOTTY;
+			numa.policy	= dev->numa;
+			numa.node	= dev->node;
+			if (copy_to_user((void __user *) arg, &numa, sizeof(numa)))
+				return -EFAULT;
+			return 0;
+
+			/*
+			 * Save to, or load from, the regular file open on
+			 * descriptor "arg".
+			 */
+		case SCULL_IOCTSNAPSHOT:
+		case SCULL_IOCTRESTORE:
+			dev = scull_ioctl_dev(filp);
+			if (!dev)
+				return -ENOTTY;
+			if (!(filp->f_mode & (cmd == SCULL_IOCTSNAPSHOT ?
+					      FMODE_READ : FMODE_WRITE)))
+				return -EBADF;
+			src = fdget(arg);
+			if (!src.file)
+				return -EBADF;
+			if (!S_ISREG(file_inode(src.file)->i_mode) ||
+			    (src.file->f_flags & O_APPEND))
+				ret = -EINVAL;
+			else if (cmd == SCULL_IOCTSNAPSHOT)
+				ret = scull_snapshot(dev, src.file);
+			else
+				ret = scull_restore(dev, src.file);
+			fdput(src);
+			return ret;
+
 		default:	/* redundant as cmd was checked against MAXNR */
 			return -ENOTTY;
 	}
@@ -459,6 +2300,82 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
  * The "extended" operations -- only seek
  */
 
+/*
+ * Find the first data (SEEK_DATA) or hole (SEEK_HOLE) at or after "pos",
+ * with quantum granularity. Like the readers, this takes no lock. The end
+ * of the device counts as a hole.
+ */
+static loff_t scull_seek_data(struct scull_dev *dev, loff_t pos, int whence)
+{
+	struct scull_store *store;
+	struct scull_qset *dptr;
+	struct radix_tree_iter iter;
+	void **slot;
+	void **data;
+	unsigned long size = 0;
+	unsigned long item;
+	unsigned long expect;
+	int quantum;
+	int qset;
+	int itemsize;
+	int s_pos;
+	int present;
+	int i;
+	loff_t found = -ENXIO;
+	int idx;
+
+	idx = srcu_read_lock(&scull_srcu);
+	store = srcu_dereference(dev->store, &scull_srcu);
+	if (store)
+		size = READ_ONCE(store->size);
+	if (pos >= size)
+		goto out;
+
+	quantum		= store->quantum;
+	qset		= store->qset;
+	itemsize	= quantum * qset;
+	item		= (long) pos / itemsize;
+	s_pos		= ((long) pos % itemsize) / quantum;
+	expect		= item;
+
+	rcu_read_lock();
+	radix_tree_for_each_slot(slot, &store->index, &iter, item) {
+		if (whence == SEEK_HOLE && iter.index != expect)
+			break;		/* a whole quantum set is missing */
+		dptr = radix_tree_deref_slot(slot);
+		if (radix_tree_deref_retry(dptr)) {
+			slot = radix_tree_iter_retry(&iter);
+			continue;
+		}
+		data = srcu_dereference(dptr->data, &scull_srcu);
+		for (i = (iter.index == item) ? s_pos : 0; i < qset; i++) {
+			present = data && READ_ONCE(data[i]);
+			if (present == (whence == SEEK_DATA)) {
+				found = (loff_t) iter.index * itemsize +
+					(loff_t) i * quantum;
+				goto found;
+			}
+		}
+		expect = iter.index + 1;
+		if ((loff_t) expect * itemsize >= size)
+			break;
+	}
+	if (whence == SEEK_HOLE)
+		found = (loff_t) expect * itemsize;
+found:
+	rcu_read_unlock();
+
+	if (found < 0)
+		goto out;
+	if (found < pos)
+		found = pos;		/* we are inside that quantum already */
+	if (found >= size)
+		found = (whence == SEEK_HOLE) ? size : -ENXIO;
+out:
+	srcu_read_unlock(&scull_srcu, idx);
+	return found;
+}
+
 loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 {
 	struct scull_dev *dev = filp->private_data;
@@ -474,7 +2391,14 @@ loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 			break;
 
 		case 2:		/* SEEK_END */
-			newpos = dev->size + off;
+			newpos = scull_size(dev) + off;
+			break;
+
+		case SEEK_DATA:
+		case SEEK_HOLE:
+			newpos = scull_seek_data(dev, off, whence);
+			if (newpos < 0)
+				return newpos;	/* -ENXIO: beyond the data */
 			break;
 
 		default:	/* can't happen */
@@ -491,6 +2415,12 @@ struct file_operations scull_fops = {
 	.llseek		= scull_llseek,
 	.read		= scull_read,
 	.write		= scull_write,
+	.read_iter	= scull_read_iter,
+	.write_iter	= scull_write_iter,
+	.mmap		= scull_mmap,
+	.fallocate	= scull_fallocate,
+	.splice_read	= scull_splice_read,
+	.splice_write	= iter_file_splice_write,
 	.unlocked_ioctl	= scull_ioctl,
 	.open		= scull_open,
 	.release	= scull_release
@@ -509,25 +2439,44 @@ void scull_cleanup_module(void)
 	int i;
 	dev_t devno = MKDEV(scull_major, scull_minor);
 
+	/* the inventory looks at all the devices: it goes first */
+	scull_remove_proc();
+
+	scull_images(1);
+
 	/* Get rid of our char dev entries */
 	if (scull_devices) {
 		for (i = 0; i < scull_nr_devs; i++) {
-			scull_trim(scull_devices + i);
+			if (scull_class)
+				device_destroy(scull_class, devno + i);
 			cdev_del(&scull_devices[i].cdev);
+			scull_dev_cleanup(scull_devices + i);
 		}
 		kfree(scull_devices);
 	}
 
-#ifdef SCULL_DEBUG	/* use proc only if debugging */
-	scull_remove_proc();
-#endif
-
 	/* cleanup_module is never called if registering failed */
 	unregister_chrdev_region(devno, scull_nr_devs);
 
 	/* and call the cleanup functions for friend devices */
+	scull_ctl_cleanup();
 	scull_p_cleanup();
 	scull_access_cleanup();
+	if (scull_class)
+		class_destroy(scull_class);
+	debugfs_remove_recursive(scull_debugfs);
+
+	/*
+	 * Let the trimmed data go, and the quanta still waiting on call_srcu:
+	 * they go back to the caches, so both go before the caches do.
+	 */
+	if (scull_wq)
+		destroy_workqueue(scull_wq);
+	srcu_barrier(&scull_srcu);
+	scull_destroy_caches();
+	if (scull_zip_tfm)
+		crypto_free_comp(scull_zip_tfm);
+	cleanup_srcu_struct(&scull_srcu);
 }
 
 /*
@@ -543,8 +2492,15 @@ static void scull_setup_cdev(struct scull_dev *dev, int index)
 	dev->cdev.ops	= &scull_fops;
 	err		= cdev_add(&dev->cdev, devno, 1);
 
-	if (err)
+	if (err) {
 		printk(KERN_NOTICE "Error %d adding scull%d", err, index);
+		return;
+	}
+	if (IS_ERR(device_create_with_groups(scull_class, NULL, devno,
+					     dev->stats, scull_stats_groups,
+					     "scull%d", index)))
+		printk(KERN_NOTICE "scull: no sysfs entry for scull%d\n",
+		       index);
 }
 
 int scull_init_module(void)
@@ -553,6 +2509,10 @@ int scull_init_module(void)
 	int i;
 	dev_t dev = 0;
 
+	result = init_srcu_struct(&scull_srcu);
+	if (result)
+		return result;
+
 	/* Get a range of minor numbers to work with, asking for a dynamic
 	 * major unless directed otherwise at load time.
 	 */
@@ -567,7 +2527,27 @@ int scull_init_module(void)
 	}
 	if (result < 0) {
 		printk(KERN_WARNING "scull: can't get major %d\n", scull_major);
-		return result;
+		goto fail_srcu;
+	}
+
+	result = scull_create_caches();
+	if (result)
+		goto fail_caches;	/* one of them may be there */
+	scull_wq = alloc_workqueue("scull", WQ_UNBOUND, 0);
+	if (!scull_wq) {
+		result = -ENOMEM;
+		goto fail_caches;
+	}
+	scull_class = class_create(THIS_MODULE, "scull");
+	if (IS_ERR(scull_class)) {
+		result = PTR_ERR(scull_class);
+		scull_class = NULL;
+		goto fail_wq;
+	}
+	scull_zip_tfm = crypto_alloc_comp("lz4", 0, 0);
+	if (IS_ERR(scull_zip_tfm)) {
+		printk(KERN_NOTICE "scull: no lz4, compression disabled\n");
+		scull_zip_tfm = NULL;
 	}
 
 	/*
@@ -578,31 +2558,55 @@ int scull_init_module(void)
 				   GFP_KERNEL);
 	if (!scull_devices) {
 		result = -ENOMEM;
-		goto fail;
+		goto fail_class;
 	}
 	memset(scull_devices, 0, scull_nr_devs * sizeof(struct scull_dev));
 
 	/* Initialize each device */
-	for (i = 0; i < scull_nr_devs; i++) {
-		scull_devices[i].quantum = scull_quantum;
-		scull_devices[i].qset	 = scull_qset;
-		init_MUTEX(&scull_devices[i].sem);
+	for (i = 0; i < scull_nr_devs; i++)
+		if (scull_dev_init(&scull_devices[i]))
+			result = -ENOMEM;
+	if (result)
+		goto fail_devices;	/* all of them can be cleaned up, though */
+	scull_images(0);	/* before anybody can open them */
+	for (i = 0; i < scull_nr_devs; i++)
 		scull_setup_cdev(&scull_devices[i], i);
-	}
 
 	/* At this point call the init function for any friend device */
 	dev = MKDEV(scull_major, scull_minor + scull_nr_devs);
 	dev += scull_p_init(dev);
 	dev += scull_access_init(dev);
+	dev += scull_ctl_init(dev);
 
-#ifdef SCULL_DEBUG
 	scull_create_proc();
-#endif
+	scull_debugfs = debugfs_create_dir("scull", NULL);
+	debugfs_create_file("latency", 0444, scull_debugfs, NULL,
+			    &scull_lat_fops);
 
 	return 0;
 
-fail:
-	scull_cleanup_module();
+	/* nothing is registered yet: undo the rest in reverse */
+fail_devices:
+	for (i = 0; i < scull_nr_devs; i++)
+		scull_dev_cleanup(scull_devices + i);
+	kfree(scull_devices);
+	scull_devices = NULL;
+fail_class:
+	class_destroy(scull_class);
+	scull_class = NULL;
+	if (scull_zip_tfm)
+		crypto_free_comp(scull_zip_tfm);
+	scull_zip_tfm = NULL;
+fail_wq:
+	destroy_workqueue(scull_wq);	/* lets the trimmed data go */
+	scull_wq = NULL;
+	srcu_barrier(&scull_srcu);
+fail_caches:
+	scull_destroy_caches();
+	unregister_chrdev_region(MKDEV(scull_major, scull_minor),
+				 scull_nr_devs);
+fail_srcu:
+	cleanup_srcu_struct(&scull_srcu);
 	return result;
 }
 
@@ -8,28 +8,22 @@
 #include <linux/slab.h>
 #include <linux/fs.h>
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #include <linux/errno.h>
 #include <linux/types.h>
 #include <linux/fcntl.h>
 #include <linux/poll.h>
 #include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
 
 #include <linux/sched.h>
 
 //#include <asm-generic/uaccess.h>
 
 #include "scull.h"
-
-struct scull_pipe {
-	wait_queue_head_t inq, outq;		/* read and write queues */
-	char *buffer, *end;			/* start of buf, end of buf */
-	int buffersize;				/* used in pointer arithmetic */
-	char *rp, *wp;				/* where to read and where to write */
-	int nreaders, nwriters;			/* number of openings for r/w */
-	struct fasync_struct *async_queue;	/* asynchronous readers */
-	struct semaphore sem;			/* mutual exclusion semaphore */
-	struct cdev cdev;
-};
+#include "scull_trace.h"
 
 /* parameters */
 static int scull_p_nr_devs = SCULL_P_NR_DEVS;	/* number of pipe devices */
@@ -44,6 +38,22 @@ static struct scull_pipe *scull_p_devices;
 static int scull_p_fasync(int fd, struct file *filp, int mode);
 static int spacefree(struct scull_pipe *dev);
 
+/* Take the device semaphore, counting the times it was busy */
+static int scull_p_down(struct scull_pipe *dev)
+{
+	u64 wait;
+	int retval;
+
+	if (!down_trylock(&dev->sem))
+		return 0;
+	scull_stat_inc(dev->stats, contended);
+	wait = ktime_get_ns();
+	retval = down_interruptible(&dev->sem);
+	if (!retval)
+		scull_sem_waited(&dev->sem, "pipe", wait);
+	return retval;
+}
+
 /*
  * open and close
  */
@@ -61,6 +71,7 @@ static int scull_p_open(struct inode *inode, struct file *filp)
 		/* allocate the buffer */
 		dev->buffer = kmalloc(scull_p_buffer, GFP_KERNEL);
 		if (!dev->buffer) {
+			scull_stat_inc(dev->stats, alloc_fails);
 			up(&dev->sem);
 			return -ENOMEM;
 		}
@@ -103,12 +114,13 @@ static int scull_p_release(struct inode *inode, struct file *filp)
  * Data management: read and write
  */
 
-static ssize_t scull_p_read(struct file *filp, char __user *buf, size_t count,
-			    loff_t *f_pos)
+static ssize_t scull_p_do_read(struct file *filp, char __user *buf,
+			       size_t count, loff_t *f_pos)
 {
 	struct scull_pipe *dev = filp->private_data;
 
-	if (down_interruptible(&dev->sem))
+	scull_stat_inc(dev->stats, read_ops);
+	if (scull_p_down(dev))
 		return -ERESTARTSYS;
 
 	while (dev->rp == dev->wp) {		/* nothing to read */
@@ -136,6 +148,7 @@ static ssize_t scull_p_read(struct file *filp, char __user *buf, size_t count,
 	if (dev->rp == dev->end)
 		dev->rp = dev->buffer;	/* wrapped */
 	up(&dev->sem);
+	scull_stat_add(dev->stats, read_bytes, count);
 
 	/* finally, awake any writers and return */
 	wake_up_interruptible(&dev->outq);
@@ -143,9 +156,22 @@ static ssize_t scull_p_read(struct file *filp, char __user *buf, size_t count,
 	return count;
 }
 
+static ssize_t scull_p_read(struct file *filp, char __user *buf, size_t count,
+			    loff_t *f_pos)
+{
+	u64 start = scull_lat_start();
+	ssize_t retval;
+
+	trace_scull_p_read_enter(filp->private_data, *f_pos, count);
+	retval = scull_p_do_read(filp, buf, count, f_pos);
+	scull_lat_end(SCULL_LAT_P_READ, start);
+	trace_scull_p_read_exit(filp->private_data, retval);
+	return retval;
+}
+
 /* Wait for space for writing; caller must hold device semaphore. On error
  * the semaphore will be released before returning */
-static int scull_getwritespace(struct scull_pipe *dev, struct file *filp)
+static int scull_do_getwritespace(struct scull_pipe *dev, struct file *filp)
 {
 	while (spacefree(dev) == 0) {	/* full */
 		DEFINE_WAIT(wait);
@@ -166,6 +192,18 @@ static int scull_getwritespace(struct scull_pipe *dev, struct file *filp)
 	return 0;
 }
 
+static int scull_getwritespace(struct scull_pipe *dev, struct file *filp)
+{
+	u64 start = scull_lat_start();
+	int retval;
+
+	trace_scull_getwritespace_enter(dev);
+	retval = scull_do_getwritespace(dev, filp);
+	scull_lat_end(SCULL_LAT_P_SPACE, start);
+	trace_scull_getwritespace_exit(dev, retval);
+	return retval;
+}
+
 /* How much space is free? */
 static int spacefree(struct scull_pipe *dev)
 {
@@ -174,13 +212,14 @@ static int spacefree(struct scull_pipe *dev)
 	return ((dev->rp + dev->buffersize - dev->wp) % dev->buffersize) - 1;
 }
 
-static ssize_t scull_p_write(struct file *filp, const char __user *buf,
-			     size_t count, loff_t *f_pos)
+static ssize_t scull_p_do_write(struct file *filp, const char __user *buf,
+				size_t count, loff_t *f_pos)
 {
 	struct scull_pipe *dev = filp->private_data;
 	int result;
 
-	if (down_interruptible(&dev->sem))
+	scull_stat_inc(dev->stats, write_ops);
+	if (scull_p_down(dev))
 		return -ERESTARTSYS;
 
 	/* Make sure there's space to write */
@@ -205,6 +244,7 @@ static ssize_t scull_p_write(struct file *filp, const char __user *buf,
 	if (dev->wp == dev->end)
 		dev->wp = dev->buffer; /* wrapped */
 	up(&dev->sem);
+	scull_stat_add(dev->stats, write_bytes, count);
 
 	/* finally, awake any reader */
 	wake_up_interruptible(&dev->inq);	/* blocked in read() and select() */
@@ -216,6 +256,19 @@ static ssize_t scull_p_write(struct file *filp, const char __user *buf,
 	return count;
 }
 
+static ssize_t scull_p_write(struct file *filp, const char __user *buf,
+			     size_t count, loff_t *f_pos)
+{
+	u64 start = scull_lat_start();
+	ssize_t retval;
+
+	trace_scull_p_write_enter(filp->private_data, *f_pos, count);
+	retval = scull_p_do_write(filp, buf, count, f_pos);
+	scull_lat_end(SCULL_LAT_P_WRITE, start);
+	trace_scull_p_write_exit(filp->private_data, retval);
+	return retval;
+}
+
 static unsigned int scull_p_poll(struct file *filp, poll_table *wait)
 {
 	struct scull_pipe *dev = filp->private_data;
@@ -259,6 +312,59 @@ struct file_operations scull_pipe_fops = {
 	.fasync		= scull_p_fasync
 };
 
+/*
+ * The rest of the inventory line of a pipe (see /proc/scull in main.c),
+ * after its name. It is built without the semaphore: the buffer pointers
+ * are looked at, never followed, so a racing open or release only makes
+ * the numbers a little off.
+ */
+void scull_p_inventory_dev(struct seq_file *s, struct scull_pipe *dev)
+{
+	int bytes = READ_ONCE(dev->buffer) ? READ_ONCE(dev->buffersize) : 0;
+	long held = 0;
+
+	if (bytes) {
+		held = READ_ONCE(dev->wp) - READ_ONCE(dev->rp);
+		if (held < 0)
+			held += bytes;
+		held = clamp_val(held, 0, bytes);
+	}
+	seq_printf(s, " size=%li bytes=%i readers=%i writers=%i\n", held,
+		   bytes, READ_ONCE(dev->nreaders), READ_ONCE(dev->nwriters));
+}
+
+int scull_p_inventory_count(void)
+{
+	return scull_p_devices ? scull_p_nr_devs : 0;
+}
+
+void scull_p_inventory(struct seq_file *s, int i)
+{
+	seq_printf(s, "scullpipe%i pipe", i);
+	scull_p_inventory_dev(s, scull_p_devices + i);
+}
+
+/*
+ * Set up and tear down one pipe; the cdev is left to the caller. The
+ * buffer comes with the first open.
+ */
+int scull_p_dev_init(struct scull_pipe *dev)
+{
+	init_waitqueue_head(&dev->inq);
+	init_waitqueue_head(&dev->outq);
+	init_MUTEX(&dev->sem);
+	dev->stats = alloc_percpu(struct scull_stats);
+	return dev->stats ? 0 : -ENOMEM;
+}
+
+void scull_p_dev_cleanup(struct scull_pipe *dev)
+{
+	kfree(dev->buffer);
+	dev->buffer = NULL;
+	free_percpu(dev->stats);
+	dev->stats = NULL;
+}
+
 /*
  * Set up a cdev entry
  */
@@ -271,8 +377,12 @@ static void scull_p_setup_cdev(struct scull_pipe *dev, int index)
 	err = cdev_add(&dev->cdev, devno, 1);
 
 	/* Fail gracefully if need be */
-	if (err)
+	if (err) {
 		printk(KERN_NOTICE "Error %d adding scullpipe%d", err, index);
+		return;
+	}
+	device_create_with_groups(scull_class, NULL, devno, dev->stats,
+				  scull_stats_groups, "scullpipe%d", index);
 }
 
 
@@ -297,14 +407,22 @@ int scull_p_init(dev_t firstdev)
 	}
 	memset(scull_p_devices, 0, scull_p_nr_devs * sizeof(struct scull_pipe));
 
-	for (i = 0; i < scull_p_nr_devs; i++) {
-		init_waitqueue_head(&(scull_p_devices[i].inq));
-		init_waitqueue_head(&(scull_p_devices[i].outq));
-		init_MUTEX(&scull_p_devices[i].sem);
+	for (i = 0; i < scull_p_nr_devs; i++)
+		if (scull_p_dev_init(scull_p_devices + i))
+			goto fail;
+
+	for (i = 0; i < scull_p_nr_devs; i++)
 		scull_p_setup_cdev(scull_p_devices + i, i);
-	}
 
 	return scull_p_nr_devs;
+
+fail:
+	for (i = 0; i < scull_p_nr_devs; i++)
+		scull_p_dev_cleanup(scull_p_devices + i);
+	kfree(scull_p_devices);
+	scull_p_devices = NULL;
+	unregister_chrdev_region(firstdev, scull_p_nr_devs);
+	return 0;
 }
 
 /*
@@ -319,8 +437,9 @@ void scull_p_cleanup(void)
 		return;		/* nothing else to release */
 
 	for (i = 0; i < scull_p_nr_devs; i++) {
+		device_destroy(scull_class, scull_p_devno + i);
 		cdev_del(&scull_p_devices[i].cdev);
-		kfree(scull_p_devices[i].buffer);
+		scull_p_dev_cleanup(scull_p_devices + i);
 	}
 	kfree(scull_p_devices);
 	unregister_chrdev_region(scull_p_devno, scull_p_nr_devs);
@@ -2,6 +2,13 @@
 #define __SCULL_H_
 
 #include <asm-generic/ioctl.h>	/* needed for the _IOW etc stuff */
+#ifdef __KERNEL__
+#include <linux/radix-tree.h>	/* the quantum-set index */
+#include <linux/workqueue.h>	/* background freeing of trimmed data */
+#include <linux/percpu.h>	/* the statistics */
+#include <linux/refcount.h>	/* shared quanta */
+#include <linux/jiffies.h>
+#endif
 
 /* Debugging Macros */
 
@@ -33,14 +40,23 @@
 #define SCULL_P_NR_DEVS 4	/* scullpipe0 through scullpipe3 */
 #endif
 
+#ifndef SCULL_CTL_MAX
+#define SCULL_CTL_MAX 65536	/* devices made through /dev/scull-control */
+#endif
+
 /*
  * The bare device is a variable-length region of memory.
- * Use a linked list of indirect blocks.
+ * Use a radix tree of indirect blocks, keyed by quantum-set number.
  *
- * "scull_dev->data" points to an array of pointers, each pointer
- * refers to a memory area of SCULL_QUANTUM bytes.
+ * "scull_store->index" maps a quantum-set number to an array of pointers,
+ * each pointer refers to a memory area of SCULL_QUANTUM bytes.
  *
- * The array (quantum-set) is SCULL_QSET long.
+ * The array (quantum-set) is SCULL_QSET long. Finding the quantum for any
+ * offset costs one tree lookup instead of a walk from the first set.
+ *
+ * On the kernels we build for (see the README) the radix tree is the
+ * xarray underneath; its API is kept for radix_tree_preload(), which lets
+ * the index grow under a spinlock, and for the tags the re-layout uses.
  */
 
 #ifndef SCULL_QUANTUM
@@ -57,24 +73,190 @@
 #define SCULL_P_BUFFER	4000
 #endif
 
+/*
+ * I/O statistics of a device, per CPU so that counting them costs no shared
+ * cache line. They are summed up in /sys/class/scull/<device>/stats.
+ */
+struct scull_stats {
+	u64 read_bytes;
+	u64 read_ops;
+	u64 write_bytes;
+	u64 write_ops;
+	u64 trims;
+	u64 alloc_fails;		/* allocations failed, or over budget */
+	u64 quanta;			/* quanta allocated */
+	u64 contended;			/* semaphores found taken */
+};
+
+#define scull_stat_inc(stats, field)	this_cpu_inc((stats)->field)
+#define scull_stat_add(stats, field, n)	this_cpu_add((stats)->field, (n))
+
+/*
+ * Latency histograms, see main.c. The operations:
+ */
+enum {
+	SCULL_LAT_READ,
+	SCULL_LAT_WRITE,
+	SCULL_LAT_FOLLOW,
+	SCULL_LAT_TRIM,
+	SCULL_LAT_P_READ,
+	SCULL_LAT_P_WRITE,
+	SCULL_LAT_P_SPACE,		/* scull_getwritespace() */
+	SCULL_LAT_SEM,			/* waiting for a semaphore */
+	SCULL_LAT_NR
+};
+
 /*
  * Representation of scull quantum sets.
  */
 struct scull_qset {
 	void **data;
-	struct scull_qset *next;
+	struct semaphore sem;		/* serializes writers of the array */
+	unsigned long atime;		/* jiffies of the last access */
 };
 
-struct scull_dev {
-	struct scull_qset *data;	/* Pointer to first quantum set */
-	int quantum;			/* the current quantum size */
-	int qset;			/* the current array size */
+/*
+ * The data of a bare device, together with the geometry it was laid out
+ * with. Lockless readers find it through dev->store, so a trim can unhook
+ * it as a whole.
+ */
+struct scull_store {
+	struct radix_tree_root index;	/* qset number -> struct scull_qset */
+	int quantum;			/* the quantum size of this data */
+	int qset;			/* the array size of this data */
 	unsigned long size;		/* amount of data stored here */
+	atomic_long_t bytes;		/* memory charged to this store */
+	atomic_long_t quanta;		/* slots in use, of whatever kind */
+	atomic_long_t zip_raw;		/* compressed quanta, before... */
+	atomic_long_t zip_bytes;	/* ...and after compression */
+	spinlock_t lock;		/* guards index growth and size */
+	int relayout;			/* being copied to a new geometry */
+	struct scull_stats __percpu *stats; /* those of the device */
+	int numa;			/* NUMA policy of the device... */
+	int node;			/* ...and its node, for SCULL_NUMA_NODE */
+	int next_node;			/* for SCULL_NUMA_INTERLEAVE */
+	atomic_long_t *node_quanta;	/* plain quanta, by node */
+	struct work_struct free_work;	/* frees it once trimmed */
+};
+
+struct scull_dev {
+	struct scull_store __rcu *store;	/* the data, NULL when empty */
+	int quantum;			/* the quantum size for new data */
+	int qset;			/* the array size for new data */
+	int own_geometry;		/* set by ioctl, kept across trims */
+	atomic_t mapped;		/* mappings, which pin the geometry */
+	struct address_space mapping;	/* they hang off this, for trim */
+	atomic_t opens;			/* open file descriptions */
+	struct work_struct relayout_work; /* moves data to a new geometry */
 	unsigned int access_key;	/* used by sculluid and scullpriv */
-	struct semaphore sem;		/* mutual exclusion semaphore */
+	struct rw_semaphore sem;	/* shared for writes, exclusive for trim */
+	struct scull_stats __percpu *stats;
+	int zip;			/* compress cold quanta */
+	int dedup;			/* share identical cold quanta */
+	struct delayed_work scan_work;	/* looks for cold quanta */
+	int numa;			/* where new quanta go: SCULL_NUMA_* */
+	int node;			/* for SCULL_NUMA_NODE */
 	struct cdev cdev;		/* char device structure */
 };
 
+/*
+ * The pipe device, a circular buffer
+ */
+struct scull_pipe {
+	wait_queue_head_t inq, outq;		/* read and write queues */
+	char *buffer, *end;			/* start of buf, end of buf */
+	int buffersize;				/* used in pointer arithmetic */
+	char *rp, *wp;				/* where to read and where to write */
+	int nreaders, nwriters;			/* number of openings for r/w */
+	struct fasync_struct *async_queue;	/* asynchronous readers */
+	struct semaphore sem;			/* mutual exclusion semaphore */
+	struct scull_stats __percpu *stats;	/* I/O statistics */
+	struct cdev cdev;
+};
+
+/*
+ * A slot of a quantum-set array normally points to its own quantum. The two
+ * low pointer bits tag the other kinds of slot:
+ *
+ *  - SCULL_SLOT_ZIP: a struct scull_zquantum, compressed by the scan worker
+ *    (see "Compression" in main.c);
+ *  - SCULL_SLOT_SHARED: a struct scull_shared, a read-only quantum shared
+ *    by reference between slots, stores and devices (see "Deduplication"
+ *    in main.c);
+ *  - SCULL_SLOT_ZERO, the shared tag alone: a quantum of zeros, which takes
+ *    no memory at all.
+ *
+ * Tagged slots are never written to: a writer first puts a plain quantum of
+ * its own in their place.
+ */
+struct scull_zquantum {
+	struct rcu_head rcu;		/* freed after the lockless readers */
+	unsigned int len;		/* length of the compressed data */
+	u8 data[];
+};
+
+struct scull_shared {
+	refcount_t ref;			/* one per slot pointing here */
+	int quantum;			/* the size of "data" */
+	void *data;			/* a quantum, never written again */
+	u32 hash;			/* of the contents, when hashed */
+	struct hlist_node node;		/* in scull_dedup_table */
+	struct rcu_head rcu;		/* freed after the lockless readers */
+};
+
+#define SCULL_SLOT_ZIP		1UL
+#define SCULL_SLOT_SHARED	2UL
+#define SCULL_SLOT_TAGS		3UL
+#define SCULL_SLOT_ZERO		((void *) SCULL_SLOT_SHARED)
+
+static inline int scull_slot_plain(const void *slot)
+{
+	return ((unsigned long) slot & SCULL_SLOT_TAGS) == 0;
+}
+
+static inline int scull_slot_zipped(const void *slot)
+{
+	return ((unsigned long) slot & SCULL_SLOT_ZIP) != 0;
+}
+
+static inline int scull_slot_shared(const void *slot)
+{
+	return ((unsigned long) slot & SCULL_SLOT_SHARED) != 0 &&
+	       slot != SCULL_SLOT_ZERO;
+}
+
+static inline struct scull_zquantum *scull_slot_zq(const void *slot)
+{
+	return (struct scull_zquantum *) ((unsigned long) slot &
+					  ~SCULL_SLOT_TAGS);
+}
+
+static inline struct scull_shared *scull_slot_sq(const void *slot)
+{
+	return (struct scull_shared *) ((unsigned long) slot &
+					~SCULL_SLOT_TAGS);
+}
+
+static inline void *scull_sq_slot(struct scull_shared *sq)
+{
+	return (void *) ((unsigned long) sq | SCULL_SLOT_SHARED);
+}
+
+/* Kept by scull_dirty() for a store being re-laid out */
+#define SCULL_TAG_DIRTY	0
+
+/* Quanta freed in batches, see store.c */
+struct scull_reap;
+
+/*
+ * A quantum set was used: the scan worker leaves it alone for a while.
+ */
+static inline void scull_touch(struct scull_qset *dptr)
+{
+	if (READ_ONCE(dptr->atime) != jiffies)
+		WRITE_ONCE(dptr->atime, jiffies);
+}
+
 /* Split the minors into two parts */
 #define TYPE(minor)	(((minor) >> 4) & 0xf)	/* high nibble */
 #define NUM(minor)	((minor) & 0xf)		/* low nibble */
@@ -85,18 +267,92 @@ extern int scull_nr_devs;
 extern int scull_quantum;
 extern int scull_qset;
 
+extern int scull_page_quanta;
+extern unsigned long scull_max_bytes;
+extern unsigned long scull_dev_max_bytes;
+
 extern int scull_p_buffer;	/* pipe.c */
 
+extern struct class *scull_class;	/* main.c, for sysfs */
+extern const struct attribute_group *scull_stats_groups[];
+extern struct file_operations scull_fops;
+extern struct file_operations scull_pipe_fops;	/* pipe.c */
+
+extern struct srcu_struct scull_srcu;		/* store.c */
+extern struct workqueue_struct *scull_wq;
+extern atomic_long_t scull_used_bytes;
+
+struct seq_file;
+
 /* Prototypes for shared functions */
 int	scull_p_init(dev_t dev);
 void	scull_p_cleanup(void);
 int	scull_access_init(dev_t dev);
 void	scull_access_cleanup(void);
+int	scull_ctl_init(dev_t dev);
+void	scull_ctl_cleanup(void);
+int	scull_p_dev_init(struct scull_pipe *dev);
+void	scull_p_dev_cleanup(struct scull_pipe *dev);
+int	scull_p_inventory_count(void);
+void	scull_p_inventory(struct seq_file *s, int i);
+void	scull_p_inventory_dev(struct seq_file *s, struct scull_pipe *dev);
+int	scull_ctl_inventory_next(int *id);
+void	scull_ctl_inventory(struct seq_file *s, int id);
+int	scull_access_inventory_count(void);
+void	scull_access_inventory(struct seq_file *s, int i);
+void	scull_inventory_dev(struct seq_file *s, struct scull_dev *dev);
+int	scull_dev_init(struct scull_dev *dev);
+int	scull_geometry_ok(int quantum, int qset);
+void	scull_dev_cleanup(struct scull_dev *dev);
 int	scull_trim(struct scull_dev *dev);
+unsigned long scull_size(struct scull_dev *dev);
+u64	scull_lat_start(void);
+void	scull_lat_end(int op, u64 start);
+void	scull_lat_add(int op, u64 ns);
+void	scull_sem_waited(const void *sem, const char *what, u64 wait);
+int	scull_paged(int quantum);
+int	scull_page_backed(int quantum);
+int	scull_create_caches(void);
+void	scull_destroy_caches(void);
+void	scull_free_quantum(void *data, int quantum);
+void	scull_node_add(struct scull_store *store, const void *quantum, int n);
+void	scull_free_slot(void *slot, int quantum);
+void	scull_forget_slot(struct scull_store *store, void *slot);
+struct scull_store *scull_alloc_store(struct scull_dev *dev);
+void	scull_free_store(struct scull_store *store);
+struct scull_store *scull_get_store(struct scull_dev *dev);
+void	scull_free_store_work(struct work_struct *work);
+struct scull_reap *scull_reap_alloc(int quantum, gfp_t gfp);
+void	scull_reap_add(struct scull_reap *reap, void *slot);
+void	scull_reap_free(struct scull_reap *reap);
+void	scull_dirty(struct scull_store *store, unsigned long item);
+struct scull_qset *scull_lookup(struct scull_store *store, unsigned long n);
+struct scull_qset *scull_follow(struct scull_store *store, unsigned long n);
+void	*scull_own_slot(struct scull_store *store, void **data, int s_pos);
+void	**scull_fill_qset(struct scull_store *store, struct scull_qset *dptr);
+void	*scull_fill_slot(struct scull_store *store, struct scull_qset *dptr,
+			 int s_pos);
+void	scull_extend(struct scull_store *store, loff_t end);
+ssize_t	scull_store_read(struct scull_store *store, struct iov_iter *to,
+			 loff_t *f_pos);
+ssize_t	scull_store_write(struct scull_store *store, struct iov_iter *from,
+			  loff_t *f_pos);
+ssize_t	scull_do_read(struct scull_dev *dev, struct iov_iter *to, loff_t *f_pos);
+ssize_t	scull_do_write(struct scull_dev *dev, struct iov_iter *from,
+		       loff_t *f_pos);
+int	scull_unzip(struct scull_zquantum *zq, void *buf, int quantum);
+void	scull_put_shared(struct scull_shared *sq);
 ssize_t	scull_read(struct file *filp, char __user *buf, size_t count,
 		   loff_t *f_pos);
 ssize_t	scull_write(struct file *filp, const char __user *buf, size_t count,
 		    loff_t *f_pos);
+ssize_t	scull_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t	scull_write_iter(struct kiocb *iocb, struct iov_iter *from);
+int	scull_mmap(struct file *filp, struct vm_area_struct *vma);
+long	scull_fallocate(struct file *filp, int mode, loff_t offset, loff_t len);
+ssize_t	scull_splice_read(struct file *in, loff_t *ppos,
+			  struct pipe_inode_info *pipe, size_t len,
+			  unsigned int flags);
 loff_t	scull_llseek(struct file *filp, loff_t off, int whence);
 long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
 
@@ -137,7 +393,134 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
 #define SCULL_P_IOCTSIZE	_IO(SCULL_IOC_MAGIC,	13)
 #define SCULL_P_IOCQSIZE	_IO(SCULL_IOC_MAGIC,	14)
 
-#define SCULL_IOC_MAXNR	14
+/*
+ * fallocate() for the bare devices: "mode" takes the FALLOC_FL_* flags.
+ */
+struct scull_falloc {
+	int mode;
+	long long offset;
+	long long len;
+};
+
+#define SCULL_IOCFALLOCATE	_IOW(SCULL_IOC_MAGIC,  15, struct scull_falloc)
+
+/*
+ * Compression of cold quanta, per bare device.
+ */
+#define SCULL_IOCTZIP		_IO(SCULL_IOC_MAGIC,   16)
+#define SCULL_IOCQZIP		_IO(SCULL_IOC_MAGIC,   17)
+
+/*
+ * Sharing of identical cold quanta, per bare device.
+ */
+#define SCULL_IOCTDEDUP		_IO(SCULL_IOC_MAGIC,   18)
+#define SCULL_IOCQDEDUP		_IO(SCULL_IOC_MAGIC,   19)
+
+/*
+ * Copy "len" bytes of the device open on "src_fd" into this one. Whole
+ * quanta that line up are shared, copy-on-write. Returns the bytes copied.
+ */
+struct scull_copy {
+	int src_fd;
+	long long src_offset;
+	long long dst_offset;
+	long long len;
+};
+
+#define SCULL_IOCCOPY		_IOW(SCULL_IOC_MAGIC,  20, struct scull_copy)
+
+/*
+ * The geometry of one bare device. Setting it, which takes CAP_SYS_ADMIN,
+ * re-lays out existing data in the background.
+ */
+struct scull_geometry {
+	int quantum;
+	int qset;
+};
+
+#define SCULL_IOCSGEOMETRY	_IOW(SCULL_IOC_MAGIC,  21, struct scull_geometry)
+#define SCULL_IOCGGEOMETRY	_IOR(SCULL_IOC_MAGIC,  22, struct scull_geometry)
+
+/*
+ * Batched positional I/O: "nr" struct scull_io, run in offset order under
+ * one lock. Each gets the bytes moved, or a negative errno, in "result".
+ */
+#define SCULL_IO_READ	0
+#define SCULL_IO_WRITE	1
+
+struct scull_io {
+	int op;				/* SCULL_IO_READ or SCULL_IO_WRITE */
+	long long offset;
+	long long len;
+	unsigned long long buf;		/* user buffer */
+	long long result;
+};
+
+struct scull_batch {
+	int nr;
+	unsigned long long ios;		/* user array of struct scull_io */
+};
+
+#define SCULL_IOCBATCH		_IOW(SCULL_IOC_MAGIC,  23, struct scull_batch)
+
+/*
+ * Devices made at run time, through /dev/scull-control only. Creating one
+ * returns its id: it shows up as /dev/scull-<id> or /dev/scullpipe-<id>.
+ * A quantum or qset of 0 is the module default. A destroyed device goes
+ * away for good once the last file open on it is closed.
+ */
+#define SCULL_CTL_BARE	0
+#define SCULL_CTL_PIPE	1
+
+struct scull_ctl {
+	int type;			/* SCULL_CTL_BARE or SCULL_CTL_PIPE */
+	int id;				/* set on return */
+	int quantum;			/* bare devices only */
+	int qset;
+};
+
+#define SCULL_IOCXCREATE	_IOWR(SCULL_IOC_MAGIC, 24, struct scull_ctl)
+#define SCULL_IOCTDESTROY	_IO(SCULL_IOC_MAGIC,   25)
+
+/*
+ * Snapshots of a bare device: "Tell" the descriptor of a regular file to
+ * save the data to, or to load it back from. The image starts with this
+ * header (see main.c for the rest).
+ */
+#define SCULL_IMAGE_MAGIC	0x5343554cU	/* "SCUL" */
+#define SCULL_IMAGE_VERSION	1
+
+struct scull_image {
+	unsigned int magic;
+	unsigned int version;
+	int quantum;
+	int qset;
+	unsigned long long size;	/* of the device */
+	unsigned long long nr;		/* quanta in the image */
+	unsigned long long index;	/* file offset of their numbers */
+	unsigned long long data;	/* file offset of the first one */
+};
+
+#define SCULL_IOCTSNAPSHOT	_IO(SCULL_IOC_MAGIC,   26)
+#define SCULL_IOCTRESTORE	_IO(SCULL_IOC_MAGIC,   27)
+
+/*
+ * NUMA placement of the new quanta of a bare device: near the writer,
+ * round-robin over the nodes with memory, or all on "node".
+ */
+#define SCULL_NUMA_LOCAL	0
+#define SCULL_NUMA_INTERLEAVE	1
+#define SCULL_NUMA_NODE		2
+
+struct scull_numa {
+	int policy;
+	int node;			/* SCULL_NUMA_NODE only */
+};
+
+#define SCULL_IOCSNUMA		_IOW(SCULL_IOC_MAGIC,  28, struct scull_numa)
+#define SCULL_IOCGNUMA		_IOR(SCULL_IOC_MAGIC,  29, struct scull_numa)
+
+#define SCULL_IOC_MAXNR	29
 #define init_MUTEX(sem)  sema_init(sem, 1)
 
 #endif	/* __SCULL_H_ */
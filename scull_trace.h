@@ -0,0 +1,207 @@
+/*
+ * scull_trace.h -- tracepoints for the hot paths of scull
+ *
+ * They show up under /sys/kernel/tracing/events/scull. main.c defines
+ * them (CREATE_TRACE_POINTS); pipe.c only uses them.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM scull
+
+#if !defined(_SCULL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SCULL_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Entry to a read or write, bare or pipe
+ */
+DECLARE_EVENT_CLASS(scull_io_enter,
+
+	TP_PROTO(const void *dev, loff_t pos, size_t count),
+
+	TP_ARGS(dev, pos, count),
+
+	TP_STRUCT__entry(
+		__field(const void *,	dev)
+		__field(loff_t,		pos)
+		__field(size_t,		count)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= dev;
+		__entry->pos	= pos;
+		__entry->count	= count;
+	),
+
+	TP_printk("dev=%p pos=%lld count=%zu",
+		  __entry->dev, __entry->pos, __entry->count)
+);
+
+DEFINE_EVENT(scull_io_enter, scull_read_enter,
+	TP_PROTO(const void *dev, loff_t pos, size_t count),
+	TP_ARGS(dev, pos, count));
+
+DEFINE_EVENT(scull_io_enter, scull_write_enter,
+	TP_PROTO(const void *dev, loff_t pos, size_t count),
+	TP_ARGS(dev, pos, count));
+
+DEFINE_EVENT(scull_io_enter, scull_p_read_enter,
+	TP_PROTO(const void *dev, loff_t pos, size_t count),
+	TP_ARGS(dev, pos, count));
+
+DEFINE_EVENT(scull_io_enter, scull_p_write_enter,
+	TP_PROTO(const void *dev, loff_t pos, size_t count),
+	TP_ARGS(dev, pos, count));
+
+/*
+ * Exit from one of the above, or from scull_getwritespace()
+ */
+DECLARE_EVENT_CLASS(scull_io_exit,
+
+	TP_PROTO(const void *dev, ssize_t ret),
+
+	TP_ARGS(dev, ret),
+
+	TP_STRUCT__entry(
+		__field(const void *,	dev)
+		__field(ssize_t,	ret)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= dev;
+		__entry->ret	= ret;
+	),
+
+	TP_printk("dev=%p ret=%zd", __entry->dev, __entry->ret)
+);
+
+DEFINE_EVENT(scull_io_exit, scull_read_exit,
+	TP_PROTO(const void *dev, ssize_t ret),
+	TP_ARGS(dev, ret));
+
+DEFINE_EVENT(scull_io_exit, scull_write_exit,
+	TP_PROTO(const void *dev, ssize_t ret),
+	TP_ARGS(dev, ret));
+
+DEFINE_EVENT(scull_io_exit, scull_p_read_exit,
+	TP_PROTO(const void *dev, ssize_t ret),
+	TP_ARGS(dev, ret));
+
+DEFINE_EVENT(scull_io_exit, scull_p_write_exit,
+	TP_PROTO(const void *dev, ssize_t ret),
+	TP_ARGS(dev, ret));
+
+DEFINE_EVENT(scull_io_exit, scull_getwritespace_exit,
+	TP_PROTO(const void *dev, ssize_t ret),
+	TP_ARGS(dev, ret));
+
+/*
+ * Events that only name the device
+ */
+DECLARE_EVENT_CLASS(scull_dev,
+
+	TP_PROTO(const void *dev),
+
+	TP_ARGS(dev),
+
+	TP_STRUCT__entry(
+		__field(const void *,	dev)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= dev;
+	),
+
+	TP_printk("dev=%p", __entry->dev)
+);
+
+DEFINE_EVENT(scull_dev, scull_getwritespace_enter,
+	TP_PROTO(const void *dev),
+	TP_ARGS(dev));
+
+DEFINE_EVENT(scull_dev, scull_trim_enter,
+	TP_PROTO(const void *dev),
+	TP_ARGS(dev));
+
+DEFINE_EVENT(scull_dev, scull_trim_exit,
+	TP_PROTO(const void *dev),
+	TP_ARGS(dev));
+
+/*
+ * Looking up (or creating) quantum set "n" in the index of a store
+ */
+TRACE_EVENT(scull_follow_enter,
+
+	TP_PROTO(const void *store, unsigned long n),
+
+	TP_ARGS(store, n),
+
+	TP_STRUCT__entry(
+		__field(const void *,	store)
+		__field(unsigned long,	n)
+	),
+
+	TP_fast_assign(
+		__entry->store	= store;
+		__entry->n	= n;
+	),
+
+	TP_printk("store=%p n=%lu", __entry->store, __entry->n)
+);
+
+TRACE_EVENT(scull_follow_exit,
+
+	TP_PROTO(const void *store, unsigned long n, const void *qset),
+
+	TP_ARGS(store, n, qset),
+
+	TP_STRUCT__entry(
+		__field(const void *,	store)
+		__field(unsigned long,	n)
+		__field(const void *,	qset)
+	),
+
+	TP_fast_assign(
+		__entry->store	= store;
+		__entry->n	= n;
+		__entry->qset	= qset;
+	),
+
+	TP_printk("store=%p n=%lu qset=%p",
+		  __entry->store, __entry->n, __entry->qset)
+);
+
+/*
+ * Time spent waiting for a semaphore that was found taken
+ */
+TRACE_EVENT(scull_sem_wait,
+
+	TP_PROTO(const void *sem, const char *what, u64 ns),
+
+	TP_ARGS(sem, what, ns),
+
+	TP_STRUCT__entry(
+		__field(const void *,	sem)
+		__string(what,		what)
+		__field(u64,		ns)
+	),
+
+	TP_fast_assign(
+		__entry->sem	= sem;
+		__assign_str(what, what);
+		__entry->ns	= ns;
+	),
+
+	TP_printk("%s sem=%p waited=%lluns",
+		  __get_str(what), __entry->sem, __entry->ns)
+);
+
+#endif /* _SCULL_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE scull_trace
+#include <trace/define_trace.h>
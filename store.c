@@ -0,0 +1,955 @@
+/*
+ * store.c -- the data of the bare devices
+ *
+ * Quanta, the quantum sets that hold them and the index of those sets:
+ * allocating, charging, looking up, reading, writing and trimming them.
+ * The rest of the driver reaches the data through here. This file also
+ * builds in user space, against test/scull_user.h instead of the kernel
+ * headers, so that test/store_bench can time it without a module.
+ */
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/slab.h>		/* kmalloc */
+#include <linux/mm.h>		/* alloc_pages_exact */
+#include <linux/fs.h>
+#include <linux/errno.h>
+#include <linux/types.h>
+#include <linux/cdev.h>
+#include <linux/string.h>	/* memchr_inv */
+#include <linux/semaphore.h>
+#include <linux/radix-tree.h>
+#include <linux/uio.h>		/* struct iov_iter */
+#include <linux/srcu.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/nodemask.h>	/* node_states, for NUMA placement */
+#else
+#include "scull_user.h"
+#endif
+
+#include "scull.h"
+
+#ifdef __KERNEL__
+#include "scull_trace.h"
+#endif
+
+/*
+ * Memory for the data. Quanta and quantum-set arrays of the load-time
+ * geometry come from scull's own slab caches, so write bursts and trims
+ * don't fragment the shared kmalloc slabs; any other geometry set later
+ * through ioctl falls back on kmalloc(). A quantum that is a whole number of
+ * pages comes straight from the page allocator, page-aligned, so that
+ * scull_mmap() can hand it out to user space. Quanta are always zero-filled:
+ * the parts never written read back as zeros, like holes do. Loading with
+ * scull_page_quanta=1 sends every quantum to the page allocator, rounded up
+ * to whole pages.
+ */
+static struct kmem_cache *scull_quantum_cache;
+static struct kmem_cache *scull_qset_cache;
+static int scull_cache_quantum;		/* object sizes of the two caches */
+static int scull_cache_qset;
+
+int scull_paged(int quantum)
+{
+	return (quantum & ~PAGE_MASK) == 0;
+}
+
+int scull_page_backed(int quantum)
+{
+	return scull_page_quanta || scull_paged(quantum);
+}
+
+/*
+ * A quantum of 2^n pages, 2 MiB say, is taken as one compound page when
+ * the page allocator has one handy: a single allocation to make and to
+ * free, contiguous for the copies. Otherwise it falls back on
+ * alloc_pages_exact(); scull_free_quantum() tells the two apart.
+ */
+static inline int scull_compound_order(int quantum)
+{
+	if (!scull_paged(quantum) || quantum == PAGE_SIZE ||
+	    !is_power_of_2(quantum))
+		return 0;
+	return get_order(quantum);
+}
+
+/* "nid" is where to put it, or NUMA_NO_NODE for near the caller */
+static void *scull_alloc_quantum(int quantum, int nid)
+{
+	int order = scull_compound_order(quantum);
+	struct page *page;
+
+	if (order) {
+		page = alloc_pages_node(nid, GFP_KERNEL | __GFP_ZERO |
+					__GFP_COMP | __GFP_NORETRY |
+					__GFP_NOWARN, order);
+		if (page)
+			return page_address(page);
+	}
+	if (scull_page_backed(quantum) && nid == NUMA_NO_NODE)
+		return alloc_pages_exact(quantum, GFP_KERNEL | __GFP_ZERO);
+	if (scull_page_backed(quantum))
+		return alloc_pages_exact_nid(nid, quantum,
+					     GFP_KERNEL | __GFP_ZERO);
+	if (quantum == scull_cache_quantum)
+		return kmem_cache_alloc_node(scull_quantum_cache,
+					     GFP_KERNEL | __GFP_ZERO, nid);
+	return kzalloc_node(quantum, GFP_KERNEL, nid);
+}
+
+void scull_free_quantum(void *data, int quantum)
+{
+	if (!data)
+		return;
+	if (scull_compound_order(quantum) && PageCompound(virt_to_page(data)))
+		__free_pages(virt_to_page(data), scull_compound_order(quantum));
+	else if (scull_page_backed(quantum))
+		free_pages_exact(data, quantum);
+	else if (quantum == scull_cache_quantum)
+		kmem_cache_free(scull_quantum_cache, data);
+	else
+		kfree(data);
+}
+
+static void **scull_alloc_qset(int qset, int nid)
+{
+	if (qset == scull_cache_qset)
+		return kmem_cache_alloc_node(scull_qset_cache,
+					     GFP_KERNEL | __GFP_ZERO, nid);
+	return kzalloc_node(qset * sizeof(void *), GFP_KERNEL, nid);
+}
+
+static void scull_free_qset(void **data, int qset)
+{
+	if (data && qset == scull_cache_qset)
+		kmem_cache_free(scull_qset_cache, data);
+	else
+		kfree(data);
+}
+
+/*
+ * Create the caches for the load-time geometry. Quanta are copied to and
+ * from user space, so their whole object is whitelisted for usercopy.
+ */
+int scull_create_caches(void)
+{
+	if (!scull_page_backed(scull_quantum)) {
+		scull_quantum_cache = kmem_cache_create_usercopy("scull_quantum",
+				scull_quantum, 0, 0, 0, scull_quantum, NULL);
+		if (!scull_quantum_cache)
+			return -ENOMEM;
+		scull_cache_quantum = scull_quantum;
+	}
+	scull_qset_cache = kmem_cache_create("scull_qset",
+			scull_qset * sizeof(void *), 0, 0, NULL);
+	if (!scull_qset_cache)
+		return -ENOMEM;
+	scull_cache_qset = scull_qset;
+	return 0;
+}
+
+void scull_destroy_caches(void)
+{
+	kmem_cache_destroy(scull_quantum_cache);
+	kmem_cache_destroy(scull_qset_cache);
+}
+
+/*
+ * Memory accounting. Every quantum and quantum-set array is charged to its
+ * store and to the module as a whole; an allocation that would go over
+ * either budget fails with -ENOSPC. Both budgets can be changed at any time
+ * through /sys/module/scull/parameters.
+ */
+atomic_long_t scull_used_bytes = ATOMIC_LONG_INIT(0);
+
+static void scull_uncharge(struct scull_store *store, long bytes)
+{
+	atomic_long_sub(bytes, &store->bytes);
+	atomic_long_sub(bytes, &scull_used_bytes);
+}
+
+static int scull_charge(struct scull_store *store, long bytes)
+{
+	unsigned long max	= READ_ONCE(scull_max_bytes);
+	unsigned long dev_max	= READ_ONCE(scull_dev_max_bytes);
+	unsigned long mine	= atomic_long_add_return(bytes, &store->bytes);
+	unsigned long used	= atomic_long_add_return(bytes,
+							 &scull_used_bytes);
+
+	if ((max && used > max) || (dev_max && mine > dev_max)) {
+		scull_uncharge(store, bytes);
+		return -ENOSPC;
+	}
+	return 0;
+}
+
+/*
+ * NUMA placement. Each device has a policy for its new quanta and quantum
+ * sets: near the writer, round-robin over the nodes with memory, or on one
+ * node. Whatever the policy, the store counts its plain quanta by the node
+ * they actually landed on.
+ */
+static int scull_store_node(struct scull_store *store)
+{
+	int nid;
+
+	switch (READ_ONCE(store->numa)) {
+		case SCULL_NUMA_NODE:
+			return READ_ONCE(store->node);
+		case SCULL_NUMA_INTERLEAVE:
+			/* racing writers may pick the same node: no matter */
+			nid = next_node_in(READ_ONCE(store->next_node),
+					   node_states[N_MEMORY]);
+			WRITE_ONCE(store->next_node, nid);
+			return nid;
+		default:
+			return NUMA_NO_NODE;
+	}
+}
+
+void scull_node_add(struct scull_store *store, const void *quantum, int n)
+{
+	atomic_long_add(n, &store->node_quanta[page_to_nid(virt_to_page(quantum))]);
+}
+
+/*
+ * Charge and allocate a quantum for the store: the quantum, or an
+ * ERR_PTR().
+ */
+static void *scull_new_quantum(struct scull_store *store)
+{
+	void *quantum;
+
+	if (scull_charge(store, store->quantum)) {
+		scull_stat_inc(store->stats, alloc_fails);
+		return ERR_PTR(-ENOSPC);
+	}
+	quantum = scull_alloc_quantum(store->quantum, scull_store_node(store));
+	if (!quantum) {
+		scull_uncharge(store, store->quantum);
+		scull_stat_inc(store->stats, alloc_fails);
+		return ERR_PTR(-ENOMEM);
+	}
+	scull_node_add(store, quantum, 1);
+	scull_stat_inc(store->stats, quanta);
+	return quantum;
+}
+
+/*
+ * Readers walk the data without taking any lock: they find the store, its
+ * quantum sets and their quanta under SRCU, which (unlike plain RCU) lets
+ * them sleep while copying to user space. Whatever a reader may still be
+ * looking at is freed only after an SRCU grace period.
+ */
+struct srcu_struct scull_srcu;
+
+/* Trimmed stores are freed in the background, on this workqueue */
+struct workqueue_struct *scull_wq;
+
+static void scull_free_zq_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct scull_zquantum, rcu));
+}
+
+/*
+ * Free a slot nobody can reach any more.
+ */
+void scull_free_slot(void *slot, int quantum)
+{
+	if (scull_slot_plain(slot))
+		scull_free_quantum(slot, quantum);
+	else if (scull_slot_zipped(slot))
+		kfree(scull_slot_zq(slot));
+	else if (scull_slot_shared(slot))
+		scull_put_shared(scull_slot_sq(slot));
+}
+
+/*
+ * A slot is being unhooked from a live store: give back its memory charge
+ * and take it out of the compression statistics.
+ */
+void scull_forget_slot(struct scull_store *store, void *slot)
+{
+	struct scull_zquantum *zq;
+
+	if (scull_slot_plain(slot)) {
+		scull_uncharge(store, store->quantum);
+		scull_node_add(store, slot, -1);
+		return;
+	}
+	if (!scull_slot_zipped(slot))
+		return;		/* shared: charged to nobody */
+	zq = scull_slot_zq(slot);
+	scull_uncharge(store, sizeof(struct scull_zquantum) + zq->len);
+	atomic_long_sub(store->quantum, &store->zip_raw);
+	atomic_long_sub(zq->len, &store->zip_bytes);
+}
+
+/*
+ * Unhook a tagged slot from a live store, and free it once the lockless
+ * readers are done with it. Plain quanta go through a scull_reap instead.
+ */
+static void scull_drop_slot(struct scull_store *store, void *slot)
+{
+	scull_forget_slot(store, slot);
+	if (scull_slot_zipped(slot))
+		call_srcu(&scull_srcu, &scull_slot_zq(slot)->rcu,
+			  scull_free_zq_rcu);
+	else if (scull_slot_shared(slot))
+		scull_put_shared(scull_slot_sq(slot));
+}
+
+struct scull_store *scull_alloc_store(struct scull_dev *dev)
+{
+	struct scull_store *store;
+
+	store = kzalloc(sizeof(struct scull_store), GFP_KERNEL);
+	if (!store)
+		return NULL;
+	store->node_quanta = kcalloc(nr_node_ids, sizeof(atomic_long_t),
+				     GFP_KERNEL);
+	if (!store->node_quanta) {
+		kfree(store);
+		return NULL;
+	}
+	/* the index only grows under store->lock, from preloaded nodes */
+	INIT_RADIX_TREE(&store->index, GFP_NOWAIT);
+	spin_lock_init(&store->lock);
+	store->quantum	= dev->quantum;
+	store->qset	= dev->qset;
+	store->stats	= dev->stats;
+	store->numa	= dev->numa;
+	store->node	= dev->node;
+	store->next_node = first_memory_node;
+	return store;
+}
+
+/*
+ * Free a store that no reader or writer can reach any more.
+ */
+void scull_free_store(struct scull_store *store)
+{
+	struct scull_qset *dptr;
+	struct radix_tree_iter iter;
+	void **slot;
+	int i;
+
+	radix_tree_for_each_slot(slot, &store->index, &iter, 0) {
+		dptr = radix_tree_deref_slot(slot);
+		if (dptr->data) {
+			for (i = 0; i < store->qset; i++)
+				scull_free_slot(dptr->data[i],
+						store->quantum);
+			scull_free_qset(dptr->data, store->qset);
+		}
+		radix_tree_iter_delete(&store->index, &iter, slot);
+		kfree(dptr);
+	}
+	atomic_long_sub(atomic_long_read(&store->bytes), &scull_used_bytes);
+	kfree(store->node_quanta);
+	kfree(store);
+}
+
+/*
+ * Return the store of the device, creating an empty one if need be.
+ * Must be called with the device semaphore held.
+ */
+struct scull_store *scull_get_store(struct scull_dev *dev)
+{
+	struct scull_store *store = rcu_dereference_protected(dev->store, 1);
+	struct scull_store *new;
+
+	if (store)
+		return store;
+	new = scull_alloc_store(dev);
+	if (!new)
+		return NULL;
+
+	/* another writer may be doing the same thing */
+	store = cmpxchg(&dev->store, NULL, new);
+	if (store) {
+		scull_free_store(new);
+		return store;
+	}
+	return new;
+}
+
+void scull_free_store_work(struct work_struct *work)
+{
+	struct scull_store *store = container_of(work, struct scull_store,
+						 free_work);
+
+	synchronize_srcu(&scull_srcu);	/* wait for the lockless readers */
+	scull_free_store(store);
+}
+
+/*
+ * Empty out the scull device; must be called with the device semaphore held
+ * for writing. The data is only unhooked here, which takes the same time
+ * whatever the size of the device; the workqueue frees it once the lockless
+ * readers that may still be using it are gone.
+ */
+int scull_trim(struct scull_dev *dev)
+{
+	struct scull_store *store = rcu_dereference_protected(dev->store, 1);
+	u64 start = scull_lat_start();
+
+	trace_scull_trim_enter(dev);
+	RCU_INIT_POINTER(dev->store, NULL);
+	/* pages still mapped would outlive the store; fault them in anew */
+	if (atomic_read(&dev->mapped))
+		unmap_mapping_range(&dev->mapping, 0, 0, 1);
+	if (!dev->own_geometry) {
+		dev->quantum = scull_quantum;
+		dev->qset    = scull_qset;
+	}
+	if (store) {
+		INIT_WORK(&store->free_work, scull_free_store_work);
+		queue_work(scull_wq, &store->free_work);
+		scull_stat_inc(dev->stats, trims);
+	}
+	scull_lat_end(SCULL_LAT_TRIM, start);
+	trace_scull_trim_exit(dev);
+	return 0;
+}
+
+/*
+ * The current size of the device; no lock is needed.
+ */
+unsigned long scull_size(struct scull_dev *dev)
+{
+	struct scull_store *store;
+	unsigned long size = 0;
+	int idx;
+
+	idx = srcu_read_lock(&scull_srcu);
+	store = srcu_dereference(dev->store, &scull_srcu);
+	if (store)
+		size = READ_ONCE(store->size);
+	srcu_read_unlock(&scull_srcu, idx);
+	return size;
+}
+
+/*
+ * Quanta unhooked from a live store (a punched hole, say) may still be in
+ * use by lockless readers. Their slots are collected in a scull_reap batch
+ * and freed together after an SRCU grace period.
+ */
+#define SCULL_REAP_BATCH	(PAGE_SIZE / sizeof(void *) - 1)
+
+struct scull_reap {
+	int quantum;			/* the size of the quanta below */
+	int nr;
+	void *slots[SCULL_REAP_BATCH];
+};
+
+struct scull_reap *scull_reap_alloc(int quantum, gfp_t gfp)
+{
+	struct scull_reap *reap = kmalloc(sizeof(struct scull_reap), gfp);
+
+	if (reap) {
+		reap->quantum	= quantum;
+		reap->nr	= 0;
+	}
+	return reap;
+}
+
+static void scull_reap_flush(struct scull_reap *reap)
+{
+	int i;
+
+	if (!reap->nr)
+		return;
+	synchronize_srcu(&scull_srcu);
+	for (i = 0; i < reap->nr; i++)
+		scull_free_slot(reap->slots[i], reap->quantum);
+	reap->nr = 0;
+}
+
+void scull_reap_add(struct scull_reap *reap, void *slot)
+{
+	if (reap->nr == SCULL_REAP_BATCH)
+		scull_reap_flush(reap);
+	reap->slots[reap->nr++] = slot;
+}
+
+void scull_reap_free(struct scull_reap *reap)
+{
+	scull_reap_flush(reap);
+	kfree(reap);
+}
+
+/*
+ * Locking: writers take the device semaphore shared, which only keeps the
+ * store from being trimmed under them; the semaphore of each quantum set
+ * serializes the writers of its pointer array and quanta, so writers to
+ * different quantum sets run in parallel. The index only grows, under the
+ * store->lock spinlock. Readers take no lock at all (see scull_srcu): new
+ * arrays and quanta are published with rcu_assign_pointer() for them.
+ */
+
+/*
+ * A quantum set is about to change while its store is being re-laid out
+ * (see "Re-layout" in main.c): have it copied again. Must be called with
+ * the quantum-set semaphore held.
+ */
+void scull_dirty(struct scull_store *store, unsigned long item)
+{
+	if (!READ_ONCE(store->relayout))
+		return;
+	spin_lock(&store->lock);
+	radix_tree_tag_set(&store->index, item, SCULL_TAG_DIRTY);
+	spin_unlock(&store->lock);
+}
+
+/*
+ * Take a quantum-set semaphore, counting the times it was busy.
+ */
+static int scull_qset_down(struct scull_store *store, struct scull_qset *dptr)
+{
+	u64 wait;
+	int retval;
+
+	if (!down_trylock(&dptr->sem))
+		return 0;
+	scull_stat_inc(store->stats, contended);
+	wait = ktime_get_ns();
+	retval = down_interruptible(&dptr->sem);
+	if (!retval)
+		scull_sem_waited(&dptr->sem, "qset", wait);
+	return retval;
+}
+
+struct scull_qset *scull_lookup(struct scull_store *store, unsigned long n)
+{
+	struct scull_qset *qs;
+
+	rcu_read_lock();
+	qs = radix_tree_lookup(&store->index, n);
+	rcu_read_unlock();
+	return qs;
+}
+
+/*
+ * Look up quantum set "n" in the index, creating it if need be.
+ * Must be called with the device semaphore held.
+ */
+struct scull_qset *scull_follow(struct scull_store *store, unsigned long n)
+{
+	struct scull_qset *qs;
+	struct scull_qset *new;
+	u64 start = scull_lat_start();
+
+	trace_scull_follow_enter(store, n);
+	qs = scull_lookup(store, n);
+	if (qs)
+		goto out;
+
+	new = kzalloc(sizeof(struct scull_qset), GFP_KERNEL);
+	if (new == NULL)
+		goto nomem;	/* Never mind */
+	init_MUTEX(&new->sem);
+	new->atime = jiffies;
+	if (radix_tree_preload(GFP_KERNEL)) {
+		kfree(new);
+		goto nomem;
+	}
+
+	/* somebody else may have added it meanwhile */
+	spin_lock(&store->lock);
+	qs = radix_tree_lookup(&store->index, n);
+	if (!qs && !radix_tree_insert(&store->index, n, new)) {
+		qs  = new;
+		new = NULL;
+	}
+	spin_unlock(&store->lock);
+	radix_tree_preload_end();
+
+	kfree(new);
+out:
+	scull_lat_end(SCULL_LAT_FOLLOW, start);
+	trace_scull_follow_exit(store, n, qs);
+	return qs;
+
+nomem:
+	scull_stat_inc(store->stats, alloc_fails);
+	qs = NULL;
+	goto out;
+}
+
+/*
+ * Put a plain quantum of the store's own in place of a tagged slot, with
+ * the same contents, and return it.
+ * Must be called with the quantum-set semaphore held.
+ */
+void *scull_own_slot(struct scull_store *store, void **data, int s_pos)
+{
+	void *slot = data[s_pos];
+	void *quantum;
+	int err = 0;
+
+	quantum = scull_new_quantum(store);
+	if (IS_ERR(quantum))
+		return quantum;
+	if (scull_slot_zipped(slot))
+		err = scull_unzip(scull_slot_zq(slot), quantum, store->quantum);
+	else if (scull_slot_shared(slot))
+		memcpy(quantum, scull_slot_sq(slot)->data, store->quantum);
+	if (err) {
+		scull_node_add(store, quantum, -1);
+		scull_free_quantum(quantum, store->quantum);
+		scull_uncharge(store, store->quantum);
+		return ERR_PTR(err);
+	}
+	rcu_assign_pointer(data[s_pos], quantum);
+	scull_drop_slot(store, slot);
+	return quantum;
+}
+
+/*
+ * Make sure quantum "s_pos" of the quantum set exists, and return it, or an
+ * ERR_PTR(): -ENOMEM, or -ENOSPC when over budget.
+ * Must be called with the quantum-set semaphore held.
+ */
+void **scull_fill_qset(struct scull_store *store, struct scull_qset *dptr)
+{
+	void **data = dptr->data;
+
+	if (!data) {
+		if (scull_charge(store, store->qset * sizeof(void *))) {
+			scull_stat_inc(store->stats, alloc_fails);
+			return ERR_PTR(-ENOSPC);
+		}
+		data = scull_alloc_qset(store->qset,
+					scull_store_node(store));
+		if (!data) {
+			scull_uncharge(store, store->qset * sizeof(void *));
+			scull_stat_inc(store->stats, alloc_fails);
+			return ERR_PTR(-ENOMEM);
+		}
+		rcu_assign_pointer(dptr->data, data);
+	}
+	return data;
+}
+
+void *scull_fill_slot(struct scull_store *store, struct scull_qset *dptr,
+		      int s_pos)
+{
+	void **data = scull_fill_qset(store, dptr);
+	void *quantum;
+
+	if (IS_ERR(data))
+		return data;
+	if (!data[s_pos]) {
+		quantum = scull_new_quantum(store);
+		if (IS_ERR(quantum))
+			return quantum;
+		rcu_assign_pointer(data[s_pos], quantum);
+		atomic_long_inc(&store->quanta);
+	}
+	if (!scull_slot_plain(data[s_pos]))
+		return scull_own_slot(store, data, s_pos);
+	return data[s_pos];
+}
+
+/*
+ * Write a whole quantum from "from" into slot "s_pos" and return the bytes
+ * copied, or an error. Nothing of the old contents survives, so a shared or
+ * compressed quantum is not copied first, and a quantum of zeros takes no
+ * memory at all. A short copy writes nothing.
+ * Must be called with the quantum-set semaphore held.
+ */
+static ssize_t scull_write_whole(struct scull_store *store,
+				 struct scull_qset *dptr, int s_pos,
+				 struct iov_iter *from)
+{
+	void **data = scull_fill_qset(store, dptr);
+	void *old;
+	void *quantum;
+	size_t copied;
+
+	if (IS_ERR(data))
+		return PTR_ERR(data);
+	old = data[s_pos];
+	if (old && scull_slot_plain(old))
+		return copy_from_iter(old, store->quantum, from);
+
+	quantum = scull_new_quantum(store);
+	if (IS_ERR(quantum))
+		return PTR_ERR(quantum);
+	copied = copy_from_iter(quantum, store->quantum, from);
+	if (copied < store->quantum || !memchr_inv(quantum, 0, store->quantum)) {
+		scull_node_add(store, quantum, -1);
+		scull_free_quantum(quantum, store->quantum);
+		scull_uncharge(store, store->quantum);
+		if (copied < store->quantum) {
+			iov_iter_revert(from, copied);
+			return 0;
+		}
+		quantum = SCULL_SLOT_ZERO;
+	}
+	rcu_assign_pointer(data[s_pos], quantum);
+	if (old)
+		scull_drop_slot(store, old);
+	else
+		atomic_long_inc(&store->quanta);
+	return copied;
+}
+
+/*
+ * Grow the device to "end" bytes, if it is shorter.
+ */
+void scull_extend(struct scull_store *store, loff_t end)
+{
+	spin_lock(&store->lock);
+	if (store->size < end)
+		WRITE_ONCE(store->size, end);
+	spin_unlock(&store->lock);
+}
+
+/*
+ * Data Management: read and write
+ *
+ * The real work is done by scull_do_read() and scull_do_write(). They loop
+ * over as many quanta (and quantum sets) as the iov_iter asks for, taking
+ * the device semaphore only once per call, so a single syscall can move the
+ * whole requested range. read()/write() and the vectored readv()/writev()
+ * paths (read_iter/write_iter) are thin wrappers around them.
+ *
+ * The device is sparse: quanta that were never written are holes, which
+ * read back as zeros without being allocated. A whole quantum of zeros
+ * written over a hole or a tagged slot becomes SCULL_SLOT_ZERO, which
+ * takes no memory either.
+ */
+
+/*
+ * Read from a store. Must be called under scull_srcu, which keeps the
+ * quanta around; the device semaphore alone does not.
+ */
+ssize_t scull_store_read(struct scull_store *store, struct iov_iter *to,
+			 loff_t *f_pos)
+{
+	struct scull_qset *dptr;	/* the quantum set */
+	void **data;
+	void *quantum_data;
+	void *bounce = NULL;		/* for compressed quanta */
+	unsigned long item;
+	int s_pos;
+	int q_pos;
+	int rest;
+	int quantum;
+	int qset;
+	int itemsize;
+	unsigned long size;
+	size_t count;
+	size_t chunk;
+	size_t copied;
+	ssize_t retval	= 0;
+
+	quantum		= store->quantum;
+	qset		= store->qset;
+	itemsize	= quantum * qset;
+	size		= READ_ONCE(store->size);	/* writers may be extending it */
+
+	if (*f_pos >= size)
+		goto out;
+	count = iov_iter_count(to);
+	if (*f_pos + count > size)
+		count = size - *f_pos;
+
+	while (count) {
+		/* find listitem, qset, index, and offset in the quantum */
+		item	= (long) *f_pos / itemsize;
+		rest	= (long) *f_pos % itemsize;
+		s_pos	= rest / quantum;
+		q_pos	= rest % quantum;
+
+		/* look the quantum set up in the index */
+		dptr	= scull_lookup(store, item);
+		data	= dptr ? srcu_dereference(dptr->data, &scull_srcu) : NULL;
+		quantum_data = data ? srcu_dereference(data[s_pos], &scull_srcu)
+				    : NULL;
+
+		if (dptr)
+			scull_touch(dptr);
+
+		if (quantum_data == SCULL_SLOT_ZERO) {
+			quantum_data = NULL;	/* reads like a hole */
+		} else if (scull_slot_shared(quantum_data)) {
+			quantum_data = scull_slot_sq(quantum_data)->data;
+		} else if (quantum_data && scull_slot_zipped(quantum_data)) {
+			if (!bounce)
+				bounce = kmalloc(quantum, GFP_KERNEL);
+			if (!bounce || scull_unzip(scull_slot_zq(quantum_data),
+						   bounce, quantum)) {
+				if (!retval)
+					retval = bounce ? -EIO : -ENOMEM;
+				break;
+			}
+			quantum_data = bounce;
+		}
+
+		if (!quantum_data) {
+			/* zeros, up to the end of the quantum or of the set */
+			chunk = data ? quantum - q_pos : itemsize - rest;
+			chunk = min_t(size_t, count, chunk);
+			copied = iov_iter_zero(chunk, to);
+		} else {
+			/* the rest of this quantum, at most */
+			chunk = min_t(size_t, count, quantum - q_pos);
+			copied = copy_to_iter(quantum_data + q_pos, chunk, to);
+		}
+		*f_pos	+= copied;
+		retval	+= copied;
+		count	-= copied;
+		if (copied < chunk) {
+			if (!retval)
+				retval = -EFAULT;
+			break;
+		}
+	}
+
+out:
+	kfree(bounce);
+	return retval;
+}
+
+ssize_t scull_do_read(struct scull_dev *dev, struct iov_iter *to, loff_t *f_pos)
+{
+	struct scull_store *store;
+	ssize_t retval = 0;
+	u64 start = scull_lat_start();
+	int idx;
+
+	trace_scull_read_enter(dev, *f_pos, iov_iter_count(to));
+	idx = srcu_read_lock(&scull_srcu);
+	store = srcu_dereference(dev->store, &scull_srcu);
+	if (store)	/* else nothing was ever written */
+		retval = scull_store_read(store, to, f_pos);
+	srcu_read_unlock(&scull_srcu, idx);
+
+	scull_stat_inc(dev->stats, read_ops);
+	if (retval > 0)
+		scull_stat_add(dev->stats, read_bytes, retval);
+	scull_lat_end(SCULL_LAT_READ, start);
+	trace_scull_read_exit(dev, retval);
+	return retval;
+}
+
+/*
+ * Write into a store. Must be called with the device semaphore held.
+ */
+ssize_t scull_store_write(struct scull_store *store, struct iov_iter *from,
+			  loff_t *f_pos)
+{
+	struct scull_qset *dptr;
+	void *data;
+	unsigned long item;
+	int s_pos;
+	int q_pos;
+	int rest;
+	int quantum;
+	int qset;
+	int itemsize;
+	size_t count;
+	size_t chunk;
+	size_t copied;
+	ssize_t written;
+	ssize_t retval	= 0;
+	ssize_t err	= -ENOMEM;	/* reported if nothing was written */
+
+	count		= iov_iter_count(from);
+	quantum		= store->quantum;
+	qset		= store->qset;
+	itemsize	= quantum * qset;
+
+	while (count) {
+		/* find listitem, q_set, index and offset in the quantum */
+		item	= (long) *f_pos / itemsize;
+		rest	= (long) *f_pos % itemsize;
+		s_pos	= rest / quantum;
+		q_pos	= rest % quantum;
+
+		/* find (or create) the quantum set and the quantum */
+		dptr = scull_follow(store, item);
+		if (dptr == NULL)
+			break;
+		if (scull_qset_down(store, dptr)) {
+			err = -ERESTARTSYS;
+			break;
+		}
+		scull_dirty(store, item);
+		scull_touch(dptr);
+
+		/* the rest of this quantum, at most */
+		chunk = min_t(size_t, count, quantum - q_pos);
+		if (chunk == quantum) {
+			written = scull_write_whole(store, dptr, s_pos, from);
+			up(&dptr->sem);
+			if (written < 0) {
+				err = written;
+				break;
+			}
+			copied = written;
+		} else {
+			data = scull_fill_slot(store, dptr, s_pos);
+			if (IS_ERR(data)) {
+				up(&dptr->sem);
+				err = PTR_ERR(data);
+				break;
+			}
+			copied = copy_from_iter(data + q_pos, chunk, from);
+			up(&dptr->sem);
+		}
+		*f_pos	+= copied;
+		retval	+= copied;
+		count	-= copied;
+
+		/* update the size */
+		scull_extend(store, *f_pos);
+
+		if (copied < chunk) {
+			err = -EFAULT;
+			break;
+		}
+	}
+	if (count && !retval)
+		retval = err;
+	return retval;
+}
+
+ssize_t scull_do_write(struct scull_dev *dev, struct iov_iter *from,
+		       loff_t *f_pos)
+{
+	struct scull_store *store;
+	ssize_t retval = 0;
+	u64 start = scull_lat_start();
+	u64 wait;
+
+	trace_scull_write_enter(dev, *f_pos, iov_iter_count(from));
+	if (!down_read_trylock(&dev->sem)) {
+		scull_stat_inc(dev->stats, contended);
+		wait = ktime_get_ns();
+		if (down_read_killable(&dev->sem)) {
+			retval = -ERESTARTSYS;
+			goto out;
+		}
+		scull_sem_waited(&dev->sem, "dev", wait);
+	}
+	store = scull_get_store(dev);
+	if (store)
+		retval = scull_store_write(store, from, f_pos);
+	else if (iov_iter_count(from))
+		retval = -ENOMEM;
+	up_read(&dev->sem);
+
+	scull_stat_inc(dev->stats, write_ops);
+	if (retval > 0)
+		scull_stat_add(dev->stats, write_bytes, retval);
+out:
+	scull_lat_end(SCULL_LAT_WRITE, start);
+	trace_scull_write_exit(dev, retval);
+	return retval;
+}
@@ -0,0 +1,411 @@
+/*
+ * Throughput and latency of scull, from user space
+ *
+ * Drives a bare device (/dev/scullN) or a pipe (/dev/scullpipeN) with a
+ * number of threads and prints one line of JSON: the options, the
+ * throughput, and the p50/p99/p999 latency of reads and writes.
+ *
+ *   scull_bench [-d device] [-t threads] [-s size] [-p seq|rand|append]
+ *               [-r read%] [-S span] [-n ops] [-q quantum] [-Q qset]
+ *
+ * On a bare device every thread has its own file; "seq" walks a slice of
+ * the span per thread, "rand" picks aligned offsets anywhere in it, and
+ * "append" hands out consecutive offsets past the end, like O_APPEND
+ * writers would get. A bare device is emptied first, and the span is
+ * written once before the clock starts when there are reads to do. On a
+ * pipe half the threads write and the other half read, whatever the
+ * pattern, and the throughput counts the bytes through the pipe once.
+ * -q and -Q set the geometry of a bare device through SCULL_IOCSGEOMETRY
+ * (which takes CAP_SYS_ADMIN) once it is empty, so that no re-layout runs
+ * while the clock does.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+/* from scull.h, which only builds in the kernel */
+#define SCULL_IOC_MAGIC	0x81
+
+struct scull_geometry {
+	int quantum;
+	int qset;
+};
+
+#define SCULL_IOCSGEOMETRY	_IOW(SCULL_IOC_MAGIC,  21, struct scull_geometry)
+#define SCULL_IOCGGEOMETRY	_IOR(SCULL_IOC_MAGIC,  22, struct scull_geometry)
+
+enum { SEQ, RAND, APPEND };
+static const char *patterns[] = { "seq", "rand", "append" };
+
+/* the options */
+static const char *device = "/dev/scull0";
+static int nthreads	= 1;
+static size_t size	= 4000;
+static int pattern	= SEQ;
+static int read_pct	= 50;
+static long long span	= 64LL << 20;
+static long nops	= 100000;
+static int quantum;
+static int qset;
+static int pipe_mode;
+
+static long long append_pos;		/* next offset for "append" */
+static volatile int writers_done;	/* pipes: the readers may stop */
+
+/* the latencies of one kind of operation, in ns */
+struct lat {
+	uint64_t *ns;
+	long nr;
+	long max;
+	long long bytes;
+};
+
+struct worker {
+	pthread_t thread;
+	int id;
+	int fd;
+	int writer;			/* pipes only */
+	unsigned int seed;
+	struct lat reads;
+	struct lat writes;
+	char *buf;
+};
+
+static pthread_barrier_t start_line;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void lat_add(struct lat *l, uint64_t ns, ssize_t bytes)
+{
+	if (l->nr == l->max) {
+		l->max = l->max ? 2 * l->max : 1024;
+		l->ns = realloc(l->ns, l->max * sizeof(uint64_t));
+		if (!l->ns) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	l->ns[l->nr++] = ns;
+	l->bytes += bytes;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const struct lat *l, double p)
+{
+	long i;
+
+	if (!l->nr)
+		return 0;
+	i = (long) (p * l->nr);
+	return l->ns[i < l->nr ? i : l->nr - 1];
+}
+
+static long long next_offset(struct worker *w, long i)
+{
+	long long slots = span / size;
+	long long slice = slots / nthreads;
+
+	switch (pattern) {
+		case RAND:
+			return (long long) (rand_r(&w->seed) % (slots ? slots : 1)) *
+			       size;
+		case APPEND:
+			return __atomic_fetch_add(&append_pos, (long long) size,
+						  __ATOMIC_RELAXED);
+		default:
+			if (!slice)
+				return 0;
+			return ((long long) w->id * slice + i % slice) * size;
+	}
+}
+
+static void *bare_worker(void *arg)
+{
+	struct worker *w = arg;
+	long long off;
+	uint64_t t;
+	ssize_t n;
+	long i;
+	int is_read;
+
+	pthread_barrier_wait(&start_line);
+	for (i = 0; i < nops; i++) {
+		is_read = pattern != APPEND &&
+			  (int) (rand_r(&w->seed) % 100) < read_pct;
+		off = next_offset(w, i);
+		t = now_ns();
+		if (is_read)
+			n = pread(w->fd, w->buf, size, off);
+		else
+			n = pwrite(w->fd, w->buf, size, off);
+		t = now_ns() - t;
+		if (n < 0) {
+			perror(is_read ? "pread" : "pwrite");
+			exit(1);
+		}
+		lat_add(is_read ? &w->reads : &w->writes, t, n);
+	}
+	return NULL;
+}
+
+static void *pipe_worker(void *arg)
+{
+	struct worker *w = arg;
+	struct pollfd pfd = { .fd = w->fd, .events = POLLIN };
+	uint64_t t;
+	ssize_t n;
+	long i;
+
+	pthread_barrier_wait(&start_line);
+	if (w->writer) {
+		for (i = 0; i < nops; i++) {
+			t = now_ns();
+			n = write(w->fd, w->buf, size);
+			t = now_ns() - t;
+			if (n < 0) {
+				perror("write");
+				exit(1);
+			}
+			lat_add(&w->writes, t, n);
+		}
+		return NULL;
+	}
+
+	/* the pipe never says EOF: poll until the writers are done */
+	for (;;) {
+		t = now_ns();
+		n = read(w->fd, w->buf, size);
+		t = now_ns() - t;
+		if (n > 0) {
+			lat_add(&w->reads, t, n);
+			continue;
+		}
+		if (n < 0 && errno != EAGAIN) {
+			perror("read");
+			exit(1);
+		}
+		if (__atomic_load_n(&writers_done, __ATOMIC_ACQUIRE))
+			break;
+		poll(&pfd, 1, 10);
+	}
+	return NULL;
+}
+
+/* Write the whole span once, so that reads find data */
+static void prefill(int fd)
+{
+	char *buf = calloc(1, size);
+	long long off;
+
+	if (!buf) {
+		perror("calloc");
+		exit(1);
+	}
+	memset(buf, 'x', size);
+	for (off = 0; off + (long long) size <= span; off += size)
+		if (pwrite(fd, buf, size, off) < 0) {
+			perror("prefill");
+			exit(1);
+		}
+	free(buf);
+}
+
+static void merge(struct lat *to, const struct lat *from)
+{
+	long i;
+
+	for (i = 0; i < from->nr; i++)
+		lat_add(to, from->ns[i], 0);
+	to->bytes += from->bytes;
+}
+
+static void print_lat(const char *name, struct lat *l)
+{
+	qsort(l->ns, l->nr, sizeof(uint64_t), cmp_u64);
+	printf("\"%s\":{\"ops\":%ld,\"bytes\":%lld,\"p50_ns\":%llu,"
+	       "\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}",
+	       name, l->nr, l->bytes,
+	       (unsigned long long) percentile(l, 0.50),
+	       (unsigned long long) percentile(l, 0.99),
+	       (unsigned long long) percentile(l, 0.999),
+	       (unsigned long long) (l->nr ? l->ns[l->nr - 1] : 0));
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: scull_bench [-d device] [-t threads] [-s size] "
+		"[-p seq|rand|append] [-r read%%] [-S span] [-n ops] "
+		"[-q quantum] [-Q qset]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct scull_geometry geo;
+	struct worker *workers;
+	struct lat reads = { 0 }, writes = { 0 };
+	uint64_t start, elapsed;
+	double secs;
+	int opt, i, fd, err;
+
+	while ((opt = getopt(argc, argv, "d:t:s:p:r:S:n:q:Q:")) != -1) {
+		switch (opt) {
+			case 'd': device = optarg; break;
+			case 't': nthreads = atoi(optarg); break;
+			case 's': size = strtoul(optarg, NULL, 0); break;
+			case 'r': read_pct = atoi(optarg); break;
+			case 'S': span = strtoll(optarg, NULL, 0); break;
+			case 'n': nops = atol(optarg); break;
+			case 'q': quantum = atoi(optarg); break;
+			case 'Q': qset = atoi(optarg); break;
+			case 'p':
+				for (pattern = 0; pattern < 3; pattern++)
+					if (!strcmp(optarg, patterns[pattern]))
+						break;
+				if (pattern == 3)
+					usage();
+				break;
+			default:
+				usage();
+		}
+	}
+	if (nthreads < 1 || size < 1 || nops < 1 || span < (long long) size ||
+	    read_pct < 0 || read_pct > 100)
+		usage();
+	pipe_mode = strstr(device, "pipe") != NULL;
+	if (pipe_mode && nthreads < 2)
+		nthreads = 2;
+
+	/* empty, then geometry and contents, before the clock starts */
+	if (!pipe_mode) {
+		fd = open(device, O_WRONLY | O_TRUNC);	/* trims it */
+		if (fd < 0) {
+			perror(device);
+			return 1;
+		}
+		close(fd);
+		fd = open(device, O_RDWR);
+		if (fd < 0) {
+			perror(device);
+			return 1;
+		}
+		if (quantum || qset) {
+			if (ioctl(fd, SCULL_IOCGGEOMETRY, &geo) < 0) {
+				perror("SCULL_IOCGGEOMETRY");
+				return 1;
+			}
+			if (quantum)
+				geo.quantum = quantum;
+			if (qset)
+				geo.qset = qset;
+			if (ioctl(fd, SCULL_IOCSGEOMETRY, &geo) < 0) {
+				perror("SCULL_IOCSGEOMETRY");
+				return 1;
+			}
+		}
+		if (ioctl(fd, SCULL_IOCGGEOMETRY, &geo) == 0) {
+			quantum = geo.quantum;
+			qset = geo.qset;
+		}
+		if (read_pct && pattern != APPEND)
+			prefill(fd);
+		append_pos = lseek(fd, 0, SEEK_END);
+		close(fd);
+	}
+
+	workers = calloc(nthreads, sizeof(struct worker));
+	if (!workers) {
+		perror("calloc");
+		return 1;
+	}
+	pthread_barrier_init(&start_line, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+		struct worker *w = workers + i;
+
+		w->id	= i;
+		w->seed	= i + 1;
+		w->buf	= malloc(size);
+		if (!w->buf) {
+			perror("malloc");
+			return 1;
+		}
+		memset(w->buf, 'a' + i % 26, size);
+		w->writer = i < nthreads / 2;
+		if (!pipe_mode)
+			w->fd = open(device, O_RDWR);
+		else if (w->writer)
+			w->fd = open(device, O_WRONLY);
+		else
+			w->fd = open(device, O_RDONLY | O_NONBLOCK);
+		if (w->fd < 0) {
+			perror(device);
+			return 1;
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		err = pthread_create(&workers[i].thread, NULL,
+				     pipe_mode ? pipe_worker : bare_worker,
+				     workers + i);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			return 1;
+		}
+	}
+
+	pthread_barrier_wait(&start_line);
+	start = now_ns();
+	for (i = 0; i < nthreads; i++)
+		if (!pipe_mode || workers[i].writer)
+			pthread_join(workers[i].thread, NULL);
+	__atomic_store_n(&writers_done, 1, __ATOMIC_RELEASE);
+	for (i = 0; pipe_mode && i < nthreads; i++)
+		if (!workers[i].writer)
+			pthread_join(workers[i].thread, NULL);
+	elapsed = now_ns() - start;
+	secs = elapsed / 1e9;
+
+	for (i = 0; i < nthreads; i++) {
+		merge(&reads, &workers[i].reads);
+		merge(&writes, &workers[i].writes);
+		close(workers[i].fd);
+	}
+
+	printf("{\"device\":\"%s\",\"kind\":\"%s\",\"threads\":%d,"
+	       "\"size\":%zu,\"pattern\":\"%s\",\"read_pct\":%d,"
+	       "\"span\":%lld,\"quantum\":%d,\"qset\":%d,"
+	       "\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"mib_per_sec\":%.2f,",
+	       device, pipe_mode ? "pipe" : "bare", nthreads, size,
+	       pipe_mode ? "pipe" : patterns[pattern],
+	       pipe_mode ? 50 : pattern == APPEND ? 0 : read_pct,
+	       span, quantum, qset, secs,
+	       (reads.nr + writes.nr) / secs,
+	       (pipe_mode ? writes.bytes : reads.bytes + writes.bytes) /
+	       secs / (1 << 20));
+	print_lat("read", &reads);
+	printf(",");
+	print_lat("write", &writes);
+	printf("}\n");
+	return 0;
+}
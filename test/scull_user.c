@@ -0,0 +1,183 @@
+/*
+ * scull_user.c -- the rest of the kernel, for store.c in user space
+ *
+ * The radix tree behind scull_user.h, and whatever main.c would give
+ * store.c in the module: the load-time parameters, the latency histograms
+ * and the compression and deduplication hooks. Nothing ever compresses or
+ * shares a quantum here, so the last two are never called.
+ */
+
+#include <stdio.h>
+
+#include "scull_user.h"
+#include "../scull.h"
+
+/* The parameters, at their module defaults */
+int scull_quantum = SCULL_QUANTUM;
+int scull_qset	  = SCULL_QSET;
+int scull_page_quanta;
+unsigned long scull_max_bytes;
+unsigned long scull_dev_max_bytes;
+
+/*
+ * The index. Like the kernel's, a tree "height" nodes deep of 64 slots
+ * each, that only grows taller as higher numbers go in. Nodes are freed
+ * once the last item is deleted, which is how a store goes.
+ */
+struct radix_tree_node {
+	void *slots[RADIX_TREE_MAP_SIZE];
+};
+
+static unsigned long radix_tree_maxindex(int height)
+{
+	int shift = height * RADIX_TREE_MAP_SHIFT;
+
+	if (shift >= (int) (8 * sizeof(unsigned long)))
+		return ~0UL;
+	return (1UL << shift) - 1;
+}
+
+void *radix_tree_lookup(struct radix_tree_root *root, unsigned long index)
+{
+	struct radix_tree_node *node = root->rnode;
+	int height = root->height;
+	int shift;
+
+	if (index > radix_tree_maxindex(height))
+		return NULL;
+	for (; node && height > 1; height--) {
+		shift = (height - 1) * RADIX_TREE_MAP_SHIFT;
+		node = node->slots[(index >> shift) & (RADIX_TREE_MAP_SIZE - 1)];
+	}
+	return node ? node->slots[index & (RADIX_TREE_MAP_SIZE - 1)] : NULL;
+}
+
+int radix_tree_insert(struct radix_tree_root *root, unsigned long index,
+		      void *item)
+{
+	struct radix_tree_node *node;
+	void **slot;
+	int height;
+	int shift;
+
+	/* grow taller until "index" fits, the old tree under slot 0 */
+	while (!root->height || index > radix_tree_maxindex(root->height)) {
+		if (root->rnode) {
+			node = calloc(1, sizeof(struct radix_tree_node));
+			if (!node)
+				return -ENOMEM;
+			node->slots[0] = root->rnode;
+			root->rnode = node;
+		}
+		root->height++;
+	}
+
+	slot = &root->rnode;
+	for (height = root->height; height > 0; height--) {
+		if (!*slot) {
+			*slot = calloc(1, sizeof(struct radix_tree_node));
+			if (!*slot)
+				return -ENOMEM;
+		}
+		node = *slot;
+		shift = (height - 1) * RADIX_TREE_MAP_SHIFT;
+		slot = &node->slots[(index >> shift) & (RADIX_TREE_MAP_SIZE - 1)];
+	}
+	if (*slot)
+		return -EEXIST;
+	*slot = item;
+	root->count++;
+	return 0;
+}
+
+/* The first item at or after "*index" under "node", or NULL */
+static void **radix_tree_next_in(struct radix_tree_node *node, int height,
+				 unsigned long *index)
+{
+	int shift = (height - 1) * RADIX_TREE_MAP_SHIFT;
+	unsigned long span = radix_tree_maxindex(height - 1) + 1;
+	unsigned long base = *index & ~radix_tree_maxindex(height);
+	unsigned long i = (*index >> shift) & (RADIX_TREE_MAP_SIZE - 1);
+	void **slot;
+
+	for (; i < RADIX_TREE_MAP_SIZE; i++) {
+		if (!node->slots[i])
+			continue;
+		if (base + i * span > *index)
+			*index = base + i * span;
+		if (height == 1)
+			return &node->slots[i];
+		slot = radix_tree_next_in(node->slots[i], height - 1, index);
+		if (slot)
+			return slot;
+	}
+	return NULL;
+}
+
+void **radix_tree_next_item(struct radix_tree_root *root,
+			    struct radix_tree_iter *iter)
+{
+	unsigned long index = iter->next_index;
+	void **slot;
+
+	if (!root->rnode || index > radix_tree_maxindex(root->height))
+		return NULL;
+	slot = radix_tree_next_in(root->rnode, root->height, &index);
+	if (slot) {
+		iter->index	 = index;
+		iter->next_index = index + 1;
+	}
+	return slot;
+}
+
+static void radix_tree_free(struct radix_tree_node *node, int height)
+{
+	int i;
+
+	if (height > 1)
+		for (i = 0; i < RADIX_TREE_MAP_SIZE; i++)
+			if (node->slots[i])
+				radix_tree_free(node->slots[i], height - 1);
+	free(node);
+}
+
+void radix_tree_iter_delete(struct radix_tree_root *root,
+			    struct radix_tree_iter *iter, void **slot)
+{
+	*slot = NULL;
+	if (--root->count)
+		return;
+	radix_tree_free(root->rnode, root->height);
+	root->rnode	= NULL;
+	root->height	= 0;
+}
+
+/* No latency histograms: the benchmark keeps its own time */
+u64 scull_lat_start(void)
+{
+	return 0;
+}
+
+void scull_lat_end(int op, u64 start)
+{
+}
+
+void scull_lat_add(int op, u64 ns)
+{
+}
+
+void scull_sem_waited(const void *sem, const char *what, u64 wait)
+{
+}
+
+int scull_unzip(struct scull_zquantum *zq, void *buf, int quantum)
+{
+	fprintf(stderr, "scull_user: no compressed quanta here\n");
+	abort();
+}
+
+void scull_put_shared(struct scull_shared *sq)
+{
+	fprintf(stderr, "scull_user: no shared quanta here\n");
+	abort();
+}
@@ -0,0 +1,373 @@
+/*
+ * scull_user.h -- just enough of the kernel for store.c in user space
+ *
+ * store.c includes this instead of the kernel headers when __KERNEL__ is
+ * not defined, and so does everything built with it (see store_bench.c).
+ * Memory comes from malloc(), semaphores and spinlocks are pthreads ones,
+ * and the index is a small radix tree of our own (scull_user.c) laid out
+ * like the kernel's, 64 slots a node. There are no lockless readers to
+ * wait for: RCU and SRCU do nothing, and work "queued" runs at once, so a
+ * trim frees the whole store before it returns.
+ */
+
+#ifndef _SCULL_USER_H
+#define _SCULL_USER_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/types.h>
+
+/* Types and annotations */
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef unsigned int gfp_t;
+
+#define __user
+#define __rcu
+#define __percpu
+
+struct file;
+struct inode;
+struct kiocb;
+struct seq_file;
+struct vm_area_struct;
+struct pipe_inode_info;
+struct fasync_struct;
+struct class;
+struct attribute_group;
+struct file_operations;
+
+struct cdev { int unused; };
+struct address_space { int unused; };
+struct rcu_head { struct rcu_head *next; };
+struct hlist_node { struct hlist_node *next, **pprev; };
+typedef struct { int refs; } refcount_t;
+typedef struct { int unused; } wait_queue_head_t;
+
+#define ERESTARTSYS	512
+
+#define container_of(ptr, type, member) \
+	((type *) ((char *) (ptr) - offsetof(type, member)))
+#define min_t(type, x, y)	((type) (x) < (type) (y) ? (type) (x) : (type) (y))
+
+#define READ_ONCE(x)		__atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v)	__atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define cmpxchg(p, old, new)	__sync_val_compare_and_swap((p), (old), (new))
+
+/* Errors in pointers */
+#define MAX_ERRNO	4095
+
+static inline void *ERR_PTR(long error)
+{
+	return (void *) error;
+}
+
+static inline long PTR_ERR(const void *ptr)
+{
+	return (long) ptr;
+}
+
+static inline int IS_ERR(const void *ptr)
+{
+	return (unsigned long) ptr >= (unsigned long) -MAX_ERRNO;
+}
+
+static inline void *memchr_inv(const void *start, int c, size_t bytes)
+{
+	const unsigned char *p = start;
+
+	for (; bytes; p++, bytes--)
+		if (*p != (unsigned char) c)
+			return (void *) p;
+	return NULL;
+}
+
+/* Atomics */
+typedef struct { int counter; } atomic_t;
+typedef struct { long counter; } atomic_long_t;
+
+#define ATOMIC_LONG_INIT(i)	{ (i) }
+
+#define atomic_read(v)		__atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic_set(v, i)	__atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic_long_read(v)	__atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic_long_add(i, v)	__atomic_fetch_add(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic_long_sub(i, v)	__atomic_fetch_sub(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic_long_inc(v)	atomic_long_add(1, (v))
+#define atomic_long_add_return(i, v) \
+	__atomic_add_fetch(&(v)->counter, (i), __ATOMIC_RELAXED)
+
+/* Memory */
+#define PAGE_SIZE	4096UL
+#define PAGE_MASK	(~(PAGE_SIZE - 1))
+
+#define GFP_KERNEL	0x01u
+#define GFP_NOWAIT	0x02u
+#define __GFP_ZERO	0x04u
+#define __GFP_COMP	0x08u
+#define __GFP_NORETRY	0x10u
+#define __GFP_NOWARN	0x20u
+
+static inline void *kmalloc(size_t size, gfp_t gfp)
+{
+	return gfp & __GFP_ZERO ? calloc(1, size) : malloc(size);
+}
+
+#define kzalloc(size, gfp)		calloc(1, (size))
+#define kcalloc(n, size, gfp)		calloc((n), (size))
+#define kzalloc_node(size, gfp, nid)	calloc(1, (size))
+#define kfree(p)			free(p)
+
+struct kmem_cache {
+	size_t size;
+};
+
+static inline struct kmem_cache *kmem_cache_create(const char *name,
+		size_t size, size_t align, unsigned long flags, void *ctor)
+{
+	struct kmem_cache *cache = malloc(sizeof(struct kmem_cache));
+
+	if (cache)
+		cache->size = size;
+	return cache;
+}
+
+#define kmem_cache_create_usercopy(name, size, align, flags, off, len, ctor) \
+	kmem_cache_create((name), (size), (align), (flags), (ctor))
+#define kmem_cache_alloc_node(cache, gfp, nid)	kmalloc((cache)->size, (gfp))
+#define kmem_cache_free(cache, p)		free(p)
+#define kmem_cache_destroy(cache)		free(cache)
+
+/* Pages are only ever addresses here: nothing is compound, all is node 0 */
+struct page;
+
+static inline void *alloc_pages_exact(size_t size, gfp_t gfp)
+{
+	void *p = aligned_alloc(PAGE_SIZE, (size + PAGE_SIZE - 1) & PAGE_MASK);
+
+	if (p && (gfp & __GFP_ZERO))
+		memset(p, 0, size);
+	return p;
+}
+
+#define alloc_pages_exact_nid(nid, size, gfp)	alloc_pages_exact((size), (gfp))
+#define free_pages_exact(p, size)		free(p)
+#define alloc_pages_node(nid, gfp, order) \
+	((struct page *) alloc_pages_exact(PAGE_SIZE << (order), (gfp)))
+#define __free_pages(page, order)	free(page)
+#define page_address(page)		((void *) (page))
+#define virt_to_page(addr)		((struct page *) (addr))
+#define PageCompound(page)		0
+#define page_to_nid(page)		0
+
+static inline int is_power_of_2(unsigned long n)
+{
+	return n && !(n & (n - 1));
+}
+
+static inline int get_order(unsigned long size)
+{
+	int order = 0;
+
+	for (size = (size - 1) / PAGE_SIZE; size; size >>= 1)
+		order++;
+	return order;
+}
+
+#define NUMA_NO_NODE			(-1)
+#define nr_node_ids			1
+#define first_memory_node		0
+#define next_node_in(node, mask)	0
+
+/* Per-CPU counters are plain ones: the benchmark runs in one thread */
+#define alloc_percpu(type)	((type *) calloc(1, sizeof(type)))
+#define free_percpu(p)		free(p)
+#define this_cpu_inc(x)		((x)++)
+#define this_cpu_add(x, n)	((x) += (n))
+
+/* Time: there is no scan worker to look at quantum-set ages */
+#define jiffies			0UL
+
+static inline u64 ktime_get_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Locks */
+typedef pthread_spinlock_t spinlock_t;
+
+#define spin_lock_init(lock)	pthread_spin_init((lock), PTHREAD_PROCESS_PRIVATE)
+#define spin_lock(lock)		pthread_spin_lock(lock)
+#define spin_unlock(lock)	pthread_spin_unlock(lock)
+
+struct semaphore {
+	sem_t sem;
+};
+
+#define sema_init(s, n)		sem_init(&(s)->sem, 0, (n))
+#define down_trylock(s)		(sem_trywait(&(s)->sem) != 0)
+#define down_interruptible(s)	sem_wait(&(s)->sem)
+#define up(s)			sem_post(&(s)->sem)
+
+struct rw_semaphore {
+	pthread_rwlock_t lock;
+};
+
+#define init_rwsem(s)		pthread_rwlock_init(&(s)->lock, NULL)
+#define down_read_trylock(s)	(pthread_rwlock_tryrdlock(&(s)->lock) == 0)
+#define down_read_killable(s)	pthread_rwlock_rdlock(&(s)->lock)
+#define up_read(s)		pthread_rwlock_unlock(&(s)->lock)
+#define down_write(s)		pthread_rwlock_wrlock(&(s)->lock)
+#define up_write(s)		pthread_rwlock_unlock(&(s)->lock)
+
+/* RCU: no lockless readers to wait for */
+struct srcu_struct {
+	int unused;
+};
+
+#define rcu_read_lock()			do { } while (0)
+#define rcu_read_unlock()		do { } while (0)
+#define srcu_read_lock(s)		0
+#define srcu_read_unlock(s, idx)	((void) (idx))
+#define synchronize_srcu(s)		do { } while (0)
+#define call_srcu(s, head, func)	(func)(head)
+#define rcu_assign_pointer(p, v)	__atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define RCU_INIT_POINTER(p, v)		((p) = (v))
+#define rcu_dereference_protected(p, c)	(p)
+#define srcu_dereference(p, s)		__atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+
+/* Nothing is ever mapped */
+#define unmap_mapping_range(m, start, len, even_cows)	do { } while (0)
+
+/* Work runs as soon as it is queued */
+struct work_struct {
+	void (*func)(struct work_struct *work);
+};
+
+struct delayed_work {
+	struct work_struct work;
+};
+
+struct workqueue_struct;
+
+#define INIT_WORK(w, f)		((w)->func = (f))
+
+static inline bool queue_work(struct workqueue_struct *wq,
+			      struct work_struct *work)
+{
+	work->func(work);
+	return true;
+}
+
+/* The index: see scull_user.c */
+#define RADIX_TREE_MAP_SHIFT	6
+#define RADIX_TREE_MAP_SIZE	(1UL << RADIX_TREE_MAP_SHIFT)
+
+struct radix_tree_root {
+	void *rnode;			/* a node, or the item at 0 if height 0 */
+	int height;			/* levels of nodes under rnode */
+	unsigned long count;		/* items */
+};
+
+struct radix_tree_iter {
+	unsigned long index;		/* of the current item */
+	unsigned long next_index;
+};
+
+#define INIT_RADIX_TREE(root, gfp) \
+	((root)->rnode = NULL, (root)->height = 0, (root)->count = 0)
+#define radix_tree_preload(gfp)		0
+#define radix_tree_preload_end()	do { } while (0)
+#define radix_tree_tag_set(root, index, tag)	NULL	/* no re-layout here */
+#define radix_tree_deref_slot(slot)	(*(slot))
+
+void	*radix_tree_lookup(struct radix_tree_root *root, unsigned long index);
+int	radix_tree_insert(struct radix_tree_root *root, unsigned long index,
+			  void *item);
+void	**radix_tree_next_item(struct radix_tree_root *root,
+			       struct radix_tree_iter *iter);
+void	radix_tree_iter_delete(struct radix_tree_root *root,
+			       struct radix_tree_iter *iter, void **slot);
+
+#define radix_tree_for_each_slot(slot, root, iter, start)		\
+	for ((iter)->next_index = (start);				\
+	     ((slot) = radix_tree_next_item((root), (iter))) != NULL; )
+
+/* I/O: one user buffer */
+struct iov_iter {
+	char *buf;
+	size_t count;
+};
+
+#define READ	0
+#define WRITE	1
+
+static inline void iov_iter_ubuf(struct iov_iter *i, unsigned int direction,
+				 void *buf, size_t count)
+{
+	i->buf		= buf;
+	i->count	= count;
+}
+
+static inline size_t iov_iter_count(const struct iov_iter *i)
+{
+	return i->count;
+}
+
+static inline size_t copy_to_iter(const void *addr, size_t bytes,
+				  struct iov_iter *i)
+{
+	bytes = min_t(size_t, bytes, i->count);
+	memcpy(i->buf, addr, bytes);
+	i->buf		+= bytes;
+	i->count	-= bytes;
+	return bytes;
+}
+
+static inline size_t copy_from_iter(void *addr, size_t bytes,
+				    struct iov_iter *i)
+{
+	bytes = min_t(size_t, bytes, i->count);
+	memcpy(addr, i->buf, bytes);
+	i->buf		+= bytes;
+	i->count	-= bytes;
+	return bytes;
+}
+
+static inline size_t iov_iter_zero(size_t bytes, struct iov_iter *i)
+{
+	bytes = min_t(size_t, bytes, i->count);
+	memset(i->buf, 0, bytes);
+	i->buf		+= bytes;
+	i->count	-= bytes;
+	return bytes;
+}
+
+static inline void iov_iter_revert(struct iov_iter *i, size_t bytes)
+{
+	i->buf		-= bytes;
+	i->count	+= bytes;
+}
+
+/* No tracepoints */
+#define trace_scull_trim_enter(dev)			do { } while (0)
+#define trace_scull_trim_exit(dev)			do { } while (0)
+#define trace_scull_follow_enter(store, n)		do { } while (0)
+#define trace_scull_follow_exit(store, n, qset)		do { } while (0)
+#define trace_scull_read_enter(dev, pos, count)		do { } while (0)
+#define trace_scull_read_exit(dev, ret)			do { } while (0)
+#define trace_scull_write_enter(dev, pos, count)	do { } while (0)
+#define trace_scull_write_exit(dev, ret)		do { } while (0)
+
+#endif /* _SCULL_USER_H */
@@ -0,0 +1,179 @@
+/*
+ * Lookup, write and trim costs of the scull data, without the module
+ *
+ * Builds ../store.c in user space (see scull_user.h) and times it on a
+ * device of its own, for each geometry and size asked for:
+ *
+ *   store_bench [-q quantum] [-Q qset] [-s size] [-b io] [-n lookups]
+ *
+ * Without -q, -Q or -s it runs through a few of each. Every run fills the
+ * device with writes of "io" bytes, writes it over again, reads it back,
+ * looks quantum sets up at random and trims it, and prints one line of
+ * JSON: ns per write, read and lookup, the fill rate in MiB/s, and the
+ * time the trim took, in all and per quantum. Allocating the quanta is
+ * part of the fill; freeing them all is the trim, which the module does in
+ * the background instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "scull_user.h"
+#include "../scull.h"
+
+static const int quanta[]	= { 512, 4000, 4096, 65536, 2097152 };
+static const int qsets[]	= { 64, 1000 };
+static const long sizes[]	= { 1L << 20, 16L << 20, 256L << 20 };
+
+#define NR(a)	((int) (sizeof(a) / sizeof((a)[0])))
+
+static size_t io_size	= 4096;
+static long nlookups	= 1000000;
+
+static char *wbuf, *rbuf;
+
+static void bench_dev_init(struct scull_dev *dev, int quantum, int qset)
+{
+	memset(dev, 0, sizeof(struct scull_dev));
+	init_rwsem(&dev->sem);
+	dev->quantum	= quantum;
+	dev->qset	= qset;
+	dev->own_geometry = 1;		/* kept across trims */
+	dev->numa	= SCULL_NUMA_LOCAL;
+	dev->node	= NUMA_NO_NODE;
+	dev->stats	= alloc_percpu(struct scull_stats);
+	if (!dev->stats) {
+		perror("alloc_percpu");
+		exit(1);
+	}
+}
+
+/* Write or read the whole device, "io" bytes at a time; ns per call */
+static double bench_pass(struct scull_dev *dev, long size, int write)
+{
+	struct iov_iter iter;
+	loff_t pos = 0;
+	ssize_t n;
+	long calls = 0;
+	u64 start = ktime_get_ns();
+
+	while (pos < size) {
+		iov_iter_ubuf(&iter, write ? WRITE : READ, write ? wbuf : rbuf,
+			      min_t(long, io_size, size - pos));
+		n = write ? scull_do_write(dev, &iter, &pos)
+			  : scull_do_read(dev, &iter, &pos);
+		if (n <= 0) {
+			fprintf(stderr, "store_bench: %s at %lld: %zd\n",
+				write ? "write" : "read", (long long) pos, n);
+			exit(1);
+		}
+		if (!write && memcmp(rbuf, wbuf, n)) {
+			fprintf(stderr, "store_bench: bad data at %lld\n",
+				(long long) pos - n);
+			exit(1);
+		}
+		calls++;
+	}
+	return (double) (ktime_get_ns() - start) / calls;
+}
+
+static void bench(int quantum, int qset, long size)
+{
+	struct scull_dev dev;
+	struct scull_store *store;
+	unsigned long nr_qsets;
+	unsigned int seed = 1;
+	double fill, overwrite, readback, lookup;
+	long nr_quanta;
+	long i;
+	u64 start, trim;
+
+	bench_dev_init(&dev, quantum, qset);
+
+	fill = bench_pass(&dev, size, 1);
+	overwrite = bench_pass(&dev, size, 1);
+	readback = bench_pass(&dev, size, 0);
+
+	store = rcu_dereference_protected(dev.store, 1);
+	nr_quanta = atomic_long_read(&store->quanta);
+	if (scull_size(&dev) != size) {
+		fprintf(stderr, "store_bench: size %lu, not %ld\n",
+			scull_size(&dev), size);
+		exit(1);
+	}
+
+	/* every set was written, so each lookup finds one */
+	nr_qsets = (size - 1) / ((long) quantum * qset) + 1;
+	start = ktime_get_ns();
+	for (i = 0; i < nlookups; i++)
+		if (!scull_follow(store, rand_r(&seed) % nr_qsets)) {
+			fprintf(stderr, "store_bench: lookup failed\n");
+			exit(1);
+		}
+	lookup = (double) (ktime_get_ns() - start) / nlookups;
+
+	start = ktime_get_ns();
+	scull_trim(&dev);
+	trim = ktime_get_ns() - start;
+
+	printf("{\"quantum\":%d,\"qset\":%d,\"size\":%ld,\"io\":%zu,"
+	       "\"quanta\":%ld,\"qsets\":%lu,\"write_ns\":%.1f,"
+	       "\"fill_mib_per_sec\":%.1f,\"overwrite_ns\":%.1f,"
+	       "\"read_ns\":%.1f,\"lookup_ns\":%.1f,\"trim_ns\":%llu,"
+	       "\"trim_ns_per_quantum\":%.1f}\n",
+	       quantum, qset, size, io_size, nr_quanta, nr_qsets, fill,
+	       io_size / fill * 1e9 / (1 << 20), overwrite, readback, lookup,
+	       (unsigned long long) trim,
+	       nr_quanta ? (double) trim / nr_quanta : 0.0);
+	fflush(stdout);
+	free_percpu(dev.stats);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: store_bench [-q quantum] [-Q qset] [-s size] "
+		"[-b io] [-n lookups]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	int quantum = 0, qset = 0;
+	long size = 0;
+	int opt, q, s, z;
+
+	while ((opt = getopt(argc, argv, "q:Q:s:b:n:")) != -1) {
+		switch (opt) {
+			case 'q': quantum = atoi(optarg); break;
+			case 'Q': qset = atoi(optarg); break;
+			case 's': size = strtol(optarg, NULL, 0); break;
+			case 'b': io_size = strtoul(optarg, NULL, 0); break;
+			case 'n': nlookups = atol(optarg); break;
+			default:
+				usage();
+		}
+	}
+	if (quantum < 0 || qset < 0 || size < 0 || io_size < 1 || nlookups < 1)
+		usage();
+
+	wbuf = malloc(io_size);
+	rbuf = malloc(io_size);
+	if (!wbuf || !rbuf) {
+		perror("malloc");
+		return 1;
+	}
+	memset(wbuf, 's', io_size);
+
+	for (q = 0; q < NR(quanta); q++)
+		for (s = 0; s < NR(qsets); s++)
+			for (z = 0; z < NR(sizes); z++) {
+				if ((quantum && q) || (qset && s) || (size && z))
+					continue;
+				bench(quantum ? quantum : quanta[q],
+				      qset ? qset : qsets[s],
+				      size ? size : sizes[z]);
+			}
+	return 0;
+}